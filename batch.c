@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+
+#include "batch.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(MDV_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BATCH_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// Initial size of the buffer a document is read into.
+#define BATCH_READ_SIZE 16384
+
+static void *xmalloc(size_t size) {
+  void *ptr = malloc(size);
+  if (!ptr) {
+    perror("memory error");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+  void *tmp = realloc(ptr, size);
+  if (!tmp) {
+    perror("memory error");
+    exit(EXIT_FAILURE);
+  }
+  return tmp;
+}
+
+// Returns the path of a document's HTML file.
+static char *html_path(const char *path) {
+  size_t len = strlen(path);
+  if (len > 3 && strcmp(path + len - 3, ".md") == 0)
+    len -= 3;
+  char *out_path = xmalloc(len + 6);
+  memcpy(out_path, path, len);
+  memcpy(out_path + len, ".html", 6);
+  return out_path;
+}
+
+/*
+ * Blocking I/O
+ */
+
+static char *read_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t len = 0, cap = BATCH_READ_SIZE;
+  char *md = xmalloc(cap);
+  size_t len_read;
+  while ((len_read = fread(md + len, 1, cap - len - 1, f))) {
+    len += len_read;
+    if (len == cap - 1) {
+      cap *= 2;
+      md = xrealloc(md, cap);
+    }
+  }
+  if (ferror(f)) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+  md[len] = '\0';
+  return md;
+}
+
+static void write_file(const char *path, char *out, size_t out_len) {
+  char *out_path = html_path(path);
+  FILE *f = fopen(out_path, "wb");
+  if (!f || fwrite(out, 1, out_len, f) != out_len || fclose(f) == EOF) {
+    perror(out_path);
+    exit(EXIT_FAILURE);
+  }
+  free(out_path);
+}
+
+static void batch_blocking(int ndocs, char **docs, batch_fn fn, void *data) {
+  for (int i = 0; i < ndocs; i++) {
+    char *md = read_file(docs[i]);
+    char *out = NULL;
+    size_t out_len = 0;
+    fn(data, docs[i], md, &out, &out_len);
+    free(md);
+    if (out) {
+      write_file(docs[i], out, out_len);
+      free(out);
+    }
+  }
+}
+
+/*
+ * io_uring
+ */
+
+#ifdef BATCH_URING
+
+// Number of submission queue entries. Each document has at most two
+// operations in flight (closing its input while its output is opened), so
+// this many documents are handled at once.
+#define URING_ENTRIES 128
+#define URING_JOBS (URING_ENTRIES / 2)
+
+// user_data of operations whose result doesn't matter
+#define URING_IGNORE ((__u64)-1)
+
+struct uring {
+  int fd;
+  // submission queue
+  unsigned int *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int to_submit; // number of entries that haven't been submitted
+  unsigned int ignored;   // number of operations in flight with URING_IGNORE
+  // completion queue
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  // mappings
+  void *sq_ring;
+  size_t sq_ring_len, cq_ring_len, sqes_len;
+};
+
+struct job {
+  int doc; // index of the document, -1 = no document
+  int state; // 0 = opening the input, 1 = reading, 2 = opening the output,
+             // 3 = writing, 4 = closing the output
+  int fd;
+  char *md; // contents of the document
+  size_t len, cap;
+  char *out; // output from fn
+  size_t out_len, written;
+  char *out_path;
+};
+
+static int uring_setup(struct uring *ring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ring->fd == -1)
+    return 0;
+
+  // make sure every operation that is used is supported (kernel 5.6+)
+  size_t probe_len = sizeof(struct io_uring_probe) +
+                     256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_len);
+  int supported =
+      probe && (params.features & IORING_FEAT_SINGLE_MMAP) &&
+      syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe,
+              256) == 0;
+  static const int ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+                            IORING_OP_CLOSE};
+  for (size_t i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++) {
+    supported = ops[i] <= probe->last_op &&
+                (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  if (!supported) {
+    close(ring->fd);
+    return 0;
+  }
+
+  // the submission and completion rings share one mapping
+  ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(__u32);
+  ring->cq_ring_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->cq_ring_len > ring->sq_ring_len)
+    ring->sq_ring_len = ring->cq_ring_len;
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->sq_ring != MAP_FAILED)
+      munmap(ring->sq_ring, ring->sq_ring_len);
+    if (ring->sqes != MAP_FAILED)
+      munmap(ring->sqes, ring->sqes_len);
+    close(ring->fd);
+    return 0;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned int *)(sq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *)(sq + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *)(sq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(sq + params.cq_off.cqes);
+  ring->to_submit = 0;
+  ring->ignored = 0;
+  return 1;
+}
+
+static void uring_free(struct uring *ring) {
+  munmap(ring->sqes, ring->sqes_len);
+  munmap(ring->sq_ring, ring->sq_ring_len);
+  close(ring->fd);
+}
+
+// Get the next submission queue entry. It is submitted by uring_wait(), and
+// the kernel doesn't read it until then, so the caller can still fill it in.
+static struct io_uring_sqe *uring_sqe(struct uring *ring, __u8 opcode, int fd,
+                                      __u64 user_data) {
+  unsigned int tail = *ring->sq_tail;
+  unsigned int idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+  return sqe;
+}
+
+// Submit every queued entry and wait for at least one completion.
+static void uring_wait(struct uring *ring) {
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1) {
+    perror("io_uring_enter");
+    exit(EXIT_FAILURE);
+  }
+  ring->to_submit -= ret;
+}
+
+static void job_read(struct uring *ring, struct job *job, __u64 id) {
+  if (job->len == job->cap - 1) {
+    job->cap *= 2;
+    job->md = xrealloc(job->md, job->cap);
+  }
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_READ, job->fd, id);
+  sqe->addr = (__u64)(uintptr_t)(job->md + job->len);
+  sqe->len = job->cap - job->len - 1;
+  sqe->off = job->len;
+}
+
+static void job_write(struct uring *ring, struct job *job, __u64 id) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_WRITE, job->fd, id);
+  sqe->addr = (__u64)(uintptr_t)(job->out + job->written);
+  sqe->len = job->out_len - job->written;
+  sqe->off = job->written;
+}
+
+// Start the next document in a job, if there are any left.
+static void job_start(struct uring *ring, struct job *job, __u64 id,
+                      int *next_doc, int ndocs, char **docs) {
+  if (*next_doc == ndocs) {
+    job->doc = -1;
+    return;
+  }
+  job->doc = (*next_doc)++;
+  job->state = 0;
+  job->len = 0;
+  struct io_uring_sqe *sqe =
+      uring_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, id);
+  sqe->addr = (__u64)(uintptr_t)docs[job->doc];
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+// Move a job to its next state after one of its operations completed.
+static void job_step(struct uring *ring, struct job *job, __u64 id, int res,
+                     int *next_doc, int ndocs, char **docs, batch_fn fn,
+                     void *data) {
+  const char *path = docs[job->doc];
+  if (res < 0) {
+    fprintf(stderr, "%s: %s\n", job->state < 2 ? path : job->out_path,
+            strerror(-res));
+    exit(EXIT_FAILURE);
+  }
+
+  switch (job->state) {
+  case 0:
+    // the input is open, so read it
+    job->fd = res;
+    job->state = 1;
+    job_read(ring, job, id);
+    break;
+  case 1:
+    if (res > 0) {
+      job->len += res;
+      job_read(ring, job, id);
+      break;
+    }
+
+    // the whole document was read. the input is closed while it is handled
+    // and the output is opened.
+    uring_sqe(ring, IORING_OP_CLOSE, job->fd, URING_IGNORE);
+    ring->ignored++;
+    job->md[job->len] = '\0';
+    job->out = NULL;
+    job->out_len = 0;
+    job->written = 0;
+    fn(data, path, job->md, &job->out, &job->out_len);
+    if (!job->out) {
+      job_start(ring, job, id, next_doc, ndocs, docs);
+      break;
+    }
+    free(job->out_path);
+    job->out_path = html_path(path);
+    job->state = 2;
+    {
+      struct io_uring_sqe *sqe =
+          uring_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, id);
+      sqe->addr = (__u64)(uintptr_t)job->out_path;
+      sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+      sqe->len = 0666;
+    }
+    break;
+  case 2:
+    job->fd = res;
+    job->state = 3;
+    res = 0;
+    // fallthrough
+  case 3:
+    job->written += res;
+    if (job->written < job->out_len) {
+      job_write(ring, job, id);
+      break;
+    }
+    job->state = 4;
+    uring_sqe(ring, IORING_OP_CLOSE, job->fd, id);
+    break;
+  case 4:
+    free(job->out);
+    job->out = NULL;
+    job_start(ring, job, id, next_doc, ndocs, docs);
+    break;
+  }
+}
+
+static int batch_uring(int ndocs, char **docs, batch_fn fn, void *data) {
+  struct uring ring;
+  if (!uring_setup(&ring))
+    return 0;
+
+  struct job jobs[URING_JOBS];
+  int next_doc = 0;
+  int active = 0;
+  for (__u64 i = 0; i < URING_JOBS; i++) {
+    jobs[i].md = xmalloc(BATCH_READ_SIZE);
+    jobs[i].cap = BATCH_READ_SIZE;
+    jobs[i].out = NULL;
+    jobs[i].out_path = NULL;
+    job_start(&ring, &jobs[i], i, &next_doc, ndocs, docs);
+    active += jobs[i].doc != -1;
+  }
+
+  // handle completions until every job runs out of documents and every input
+  // is closed
+  while (active > 0 || ring.ignored > 0) {
+    uring_wait(&ring);
+
+    unsigned int head = *ring.cq_head;
+    unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      __u64 id = cqe->user_data;
+      int res = cqe->res;
+      __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+      if (id == URING_IGNORE) {
+        ring.ignored--;
+        continue;
+      }
+      job_step(&ring, &jobs[id], id, res, &next_doc, ndocs, docs, fn, data);
+      if (jobs[id].doc == -1)
+        active--;
+    }
+  }
+
+  for (int i = 0; i < URING_JOBS; i++) {
+    free(jobs[i].md);
+    free(jobs[i].out_path);
+  }
+  uring_free(&ring);
+  return 1;
+}
+
+#endif
+
+void batch_run(int ndocs, char **docs, batch_fn fn, void *data) {
+#ifdef BATCH_URING
+  if (batch_uring(ndocs, docs, fn, data))
+    return;
+#endif
+  batch_blocking(ndocs, docs, fn, data);
+}
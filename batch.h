@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+// Handle the contents of a document. If out is set to anything other than
+// NULL, then it must be allocated with malloc() and it is written to the
+// document's HTML file (see batch_run()) and freed.
+typedef void (*batch_fn)(void *data, const char *path, char *md, char **out,
+                         size_t *out_len);
+
+// Read every document and call fn with each one. The documents may be handled
+// in any order. Output is written next to the document, with ".md" replaced by
+// ".html" (ie: docs/a.md becomes docs/a.html).
+//
+// On Linux, this uses io_uring to keep many opens, reads, writes, and closes in
+// flight at once, so that documents are parsed while the next ones are read.
+// If io_uring isn't available (or mdv is built with -DMDV_NO_URING), then each
+// document is read and written in turn with blocking I/O.
+void batch_run(int ndocs, char **docs, batch_fn fn, void *data);
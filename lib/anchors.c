@@ -0,0 +1,533 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "anchors.h"
+#include "mdview.h"
+#include "parser.h"
+#include "util.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Index layout
+ *
+ * An index is a header, followed by an open-addressing hash table of slots,
+ * followed by the keys. Documents are keyed by their path, and anchors by the
+ * document's path, a '#', and the anchor's slug. A document's slot holds its
+ * number of headings, and an anchor's slot holds its heading's ID.
+ */
+
+#define INDEX_MAGIC "MDVX"
+#define INDEX_VERSION 1
+#define INDEX_MIN_SLOTS 64
+
+struct index_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t slots;    // number of slots, always a power of 2
+  uint32_t used;     // number of slots that are used
+  uint32_t keys_len; // length of the keys after the slots
+};
+
+struct index_slot {
+  uint32_t hash;
+  uint32_t key;     // offset of the key from the start of the keys
+  uint32_t key_len; // 0 = empty slot
+  uint32_t value;   // number of headings for documents, ID for anchors
+};
+
+#define INDEX_HEADER(index) ((struct index_header *)(index)->data)
+#define INDEX_SLOTS(index)                                                     \
+  ((struct index_slot *)((index)->data + sizeof(struct index_header)))
+#define INDEX_KEYS(index)                                                      \
+  ((char *)(index)->data + sizeof(struct index_header) +                       \
+   INDEX_HEADER(index)->slots * sizeof(struct index_slot))
+
+// FNV-1a
+static uint32_t hash_key(const char *key, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Find the slot of a key, or the empty slot it would go in.
+static struct index_slot *find_slot(const struct mdview_index *index,
+                                    const char *key, size_t len,
+                                    uint32_t hash) {
+  struct index_header *header = INDEX_HEADER(index);
+  struct index_slot *slots = INDEX_SLOTS(index);
+  const char *keys = INDEX_KEYS(index);
+  uint32_t mask = header->slots - 1;
+  for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+    struct index_slot *slot = &slots[i];
+    if (slot->key_len == 0)
+      return slot;
+    if (slot->hash == hash && slot->key_len == len &&
+        memcmp(keys + slot->key, key, len) == 0)
+      return slot;
+  }
+}
+
+// Returns the slot of a key, or NULL if it isn't in the index.
+static const struct index_slot *index_find(const struct mdview_index *index,
+                                           const char *key, size_t len) {
+  const struct index_slot *slot =
+      find_slot(index, key, len, hash_key(key, len));
+  return slot->key_len ? slot : NULL;
+}
+
+// Make room for the given number of slots and bytes of keys. Every key is
+// rehashed if the table has to grow.
+static int index_reserve(struct mdview_index *index, size_t slots,
+                         size_t keys_len) {
+  struct index_header *header = INDEX_HEADER(index);
+  size_t new_slots = header->slots;
+  while ((header->used + slots) * 2 > new_slots)
+    new_slots *= 2;
+  size_t new_len = sizeof(struct index_header) +
+                   new_slots * sizeof(struct index_slot) + header->keys_len +
+                   keys_len;
+  if (new_slots > UINT32_MAX / 2 || header->keys_len + keys_len > UINT32_MAX)
+    return 0;
+
+  if (new_slots == header->slots) {
+    if (new_len <= index->cap)
+      return 1;
+    size_t cap = index->cap;
+    while (cap < new_len)
+      cap *= 2;
+    unsigned char *tmp = realloc(index->data, cap);
+    if (!tmp) {
+      perror("realloc");
+      return 0;
+    }
+    index->data = tmp;
+    index->cap = cap;
+    return 1;
+  }
+
+  // build a bigger table and insert every slot into it
+  size_t cap = index->cap;
+  while (cap < new_len)
+    cap *= 2;
+  struct mdview_index bigger = {calloc(1, cap), 0, cap};
+  if (!bigger.data) {
+    perror("calloc");
+    return 0;
+  }
+  struct index_header *new_header = INDEX_HEADER(&bigger);
+  *new_header = *header;
+  new_header->slots = new_slots;
+  memcpy(INDEX_KEYS(&bigger), INDEX_KEYS(index), header->keys_len);
+
+  struct index_slot *old = INDEX_SLOTS(index);
+  for (uint32_t i = 0; i < header->slots; i++) {
+    if (old[i].key_len == 0)
+      continue;
+    uint32_t mask = new_slots - 1;
+    uint32_t j = old[i].hash & mask;
+    while (INDEX_SLOTS(&bigger)[j].key_len)
+      j = (j + 1) & mask;
+    INDEX_SLOTS(&bigger)[j] = old[i];
+  }
+
+  free(index->data);
+  *index = bigger;
+  index->len = sizeof(struct index_header) +
+               new_slots * sizeof(struct index_slot) + new_header->keys_len;
+  return 1;
+}
+
+// Add a key to the index, or update its value if it is already there.
+static int index_insert(struct mdview_index *index, const char *key,
+                        size_t len, uint32_t value) {
+  if (!index_reserve(index, 1, len))
+    return 0;
+
+  uint32_t hash = hash_key(key, len);
+  struct index_slot *slot = find_slot(index, key, len, hash);
+  if (slot->key_len == 0) {
+    struct index_header *header = INDEX_HEADER(index);
+    memcpy(INDEX_KEYS(index) + header->keys_len, key, len);
+    slot->hash = hash;
+    slot->key = header->keys_len;
+    slot->key_len = len;
+    header->keys_len += len;
+    header->used++;
+    index->len += len;
+  }
+  slot->value = value;
+  return 1;
+}
+
+int mdview_index_init(struct mdview_index *index) {
+  size_t len = sizeof(struct index_header) +
+               INDEX_MIN_SLOTS * sizeof(struct index_slot);
+  index->cap = len + BUFSIZ;
+  index->data = calloc(1, index->cap);
+  if (!index->data) {
+    perror("calloc");
+    return 0;
+  }
+  index->len = len;
+
+  struct index_header *header = INDEX_HEADER(index);
+  memcpy(header->magic, INDEX_MAGIC, 4);
+  header->version = INDEX_VERSION;
+  header->slots = INDEX_MIN_SLOTS;
+  return 1;
+}
+
+/*
+ * Paths and slugs
+ */
+
+// Add a path to the path in the buffer, with "." and ".." components resolved
+// and repeated '/'s removed. Relative paths are added to the end of the path
+// that is already in the buffer, and absolute paths replace it. ".."
+// components that can't be resolved are kept.
+static int add_path(struct mdview_buf *buf, const char *path, size_t len) {
+  if (len > 0 && path[0] == '/') {
+    buf->len = 0;
+    if (!bufadd(buf, '/'))
+      return 0;
+  }
+
+  size_t i = 0;
+  while (i < len) {
+    size_t end = i;
+    while (end < len && path[end] != '/')
+      end++;
+    size_t seg_len = end - i;
+    const char *seg = path + i;
+    i = end + 1;
+
+    if (seg_len == 0 || (seg_len == 1 && seg[0] == '.'))
+      continue;
+    if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+      size_t last = buf->len;
+      while (last > 0 && buf->buf[last - 1] != '/')
+        last--;
+      size_t last_len = buf->len - last;
+      if (last_len > 0 && !(last_len == 2 && buf->buf[last] == '.' &&
+                            buf->buf[last + 1] == '.')) {
+        // remove the last component and the '/' before it, except for a root
+        // '/'
+        buf->len = last > 1 ? last - 1 : last;
+        buf->buf[buf->len] = '\0';
+        continue;
+      }
+      if (buf->len == 1 && buf->buf[0] == '/')
+        continue; // the root is its own parent
+    }
+
+    if (buf->len > 0 && buf->buf[buf->len - 1] != '/' && !bufadd(buf, '/'))
+      return 0;
+    if (!bufcat(buf, (char *)seg, seg_len))
+      return 0;
+  }
+  return 1;
+}
+
+// Add the directory that a document is in to the buffer.
+static int add_doc_dir(struct mdview_buf *buf, const char *doc_path) {
+  const char *slash = strrchr(doc_path, '/');
+  if (!slash)
+    return 1;
+  return add_path(buf, doc_path, slash == doc_path ? 1 : slash - doc_path);
+}
+
+// Returns the length of an HTML entity (ie: "&lt;") at the start of text, or 0
+// if there isn't one.
+static size_t entity_len(const char *text, size_t len) {
+  size_t i = 1;
+  while (i < len && (isalnum((unsigned char)text[i]) || text[i] == '#'))
+    i++;
+  return i > 1 && i < len && text[i] == ';' ? i + 1 : 0;
+}
+
+// Add a slug of the HTML text of a heading to the buffer. Tags, entities, and
+// punctuation are removed, letters are lowercased, and spaces become '-'.
+static int add_slug(struct mdview_buf *buf, const char *text, size_t len) {
+  while (len > 0 && isspace((unsigned char)text[len - 1]))
+    len--;
+  while (len > 0 && isspace((unsigned char)*text)) {
+    text++;
+    len--;
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char ch = text[i];
+    if (ch == '<') {
+      while (i < len && text[i] != '>')
+        i++;
+    } else if (ch == '&' && entity_len(text + i, len - i)) {
+      i += entity_len(text + i, len - i) - 1;
+    } else if (ch == ' ' || ch == '-') {
+      if (!bufadd(buf, '-'))
+        return 0;
+    } else if (isalnum(ch) || ch == '_' || ch >= 0x80) {
+      if (!bufadd(buf, tolower(ch)))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Building the index
+ */
+
+int index_heading(struct mdview_ctx *ctx) {
+  struct mdview_buf key = {NULL, 0, 0};
+  int success = add_path(&key, ctx->doc_path, strlen(ctx->doc_path)) &&
+                key.len > 0 && bufadd(&key, '#') &&
+                add_slug(&key, ctx->html_out.buf + ctx->heading_start,
+                         ctx->html_out.len - ctx->heading_start);
+
+  // repeated slugs get a number, starting with "-1"
+  size_t len = key.len;
+  for (unsigned int n = 1; success && index_find(ctx->indexing, key.buf,
+                                                 key.len); n++) {
+    char suffix[16];
+    key.len = len;
+    success = bufcat(&key, suffix,
+                     snprintf(suffix, sizeof(suffix), "-%u", n));
+  }
+
+  success = success &&
+            index_insert(ctx->indexing, key.buf, key.len, ctx->id_cnt);
+  free(key.buf);
+  return success;
+}
+
+int mdview_index_add(struct mdview_index *index, const char *path,
+                     const char *md) {
+  if (index->cap == 0)
+    return 0;
+
+  struct mdview_ctx ctx;
+  mdview_init(&ctx);
+  ctx.indexing = index;
+  ctx.doc_path = path;
+
+  // Characters are handled directly instead of through mdview_feed(), so
+  // html_out is never cleared (not even by mdview_flush()) and still holds the
+  // text of each heading when it is closed. Only headings are needed, so it is
+  // cleared outside of them instead of growing with the whole document.
+  int success = 1;
+  for (; success && *md; md++) {
+    success = handle_char(&ctx, *md);
+    if (ctx.block_type < 1 || ctx.block_type > 6)
+      bufclear(&ctx.html_out);
+  }
+  success = success && mdview_flush(&ctx);
+
+  // the document's slot holds its number of headings
+  struct mdview_buf key = {NULL, 0, 0};
+  success = success && add_path(&key, path, strlen(path)) && key.len > 0 &&
+            index_insert(index, key.buf, key.len, ctx.id_cnt);
+  free(key.buf);
+  mdview_free(&ctx);
+  return success;
+}
+
+/*
+ * Resolving links
+ */
+
+// Returns 1 if the URL might point at another document: it has no scheme, and
+// isn't relative to the root of the site.
+static int is_local_url(const char *url) {
+  if (url[0] == '/' || url[0] == '\0')
+    return 0;
+  for (const char *ch = url; *ch && *ch != '/' && *ch != '#'; ch++) {
+    if (*ch == ':' || *ch == '?')
+      return 0;
+  }
+  return 1;
+}
+
+// Look up the ID of an anchor in a document, which is in the key. Anchors can
+// be slugs or numeric IDs. The ID is 0 if the anchor doesn't exist. Returns 0
+// on error, 1 on success.
+static int find_anchor(struct mdview_ctx *ctx, struct mdview_buf *key,
+                       uint32_t headings, const char *anchor, uint32_t *id) {
+  size_t anchor_len = strlen(anchor);
+  if (!bufadd(key, '#') || !bufcat(key, (char *)anchor, anchor_len))
+    return 0;
+  const struct index_slot *slot = index_find(ctx->index, key->buf, key->len);
+  if (slot) {
+    *id = slot->value;
+    return 1;
+  }
+
+  // numeric IDs are valid as long as the document has that many headings
+  *id = 0;
+  if (anchor_len > 0 && anchor_len <= 9 &&
+      strspn(anchor, "0123456789") == anchor_len) {
+    uint32_t n = strtoul(anchor, NULL, 10);
+    if (n <= headings)
+      *id = n;
+  }
+  return 1;
+}
+
+// Resolve a link against the index. Returns 0 on error, 1 if the URL was
+// written as it is, and 2 if it was rewritten.
+static int resolve_link(struct mdview_ctx *ctx, char *url,
+                        struct mdview_buf *key) {
+  // only links to markdown documents or to anchors are resolved
+  const char *hash = strchr(url, '#');
+  size_t path_len = hash ? (size_t)(hash - url) : strlen(url);
+  if (path_len == 0 ? !hash || !ctx->doc_path
+                    : path_len < 4 || memcmp(url + path_len - 3, ".md", 3))
+    return 1;
+
+  if (path_len == 0) {
+    if (!add_path(key, ctx->doc_path, strlen(ctx->doc_path)))
+      return 0;
+  } else if ((ctx->doc_path && !add_doc_dir(key, ctx->doc_path)) ||
+             !add_path(key, url, path_len)) {
+    return 0;
+  }
+
+  int found = 0;
+  uint32_t id = 0;
+  const struct index_slot *doc =
+      key->len > 0 ? index_find(ctx->index, key->buf, key->len) : NULL;
+  if (doc && hash) {
+    if (!find_anchor(ctx, key, doc->value, hash + 1, &id))
+      return 0;
+    found = id > 0;
+  } else if (doc) {
+    found = 1;
+  }
+
+  if (!found) {
+    return bufcat(&ctx->broken_links, url, strlen(url)) &&
+           bufadd(&ctx->broken_links, '\n');
+  }
+
+  // link to the HTML version of the document, and to its heading's ID
+  if (path_len > 0 && (!bufcat(ctx->curr_buf, url, path_len - 3) ||
+                       !bufcat(ctx->curr_buf, ".html", 5)))
+    return 0;
+  if (hash) {
+    char anchor[16];
+    if (!bufcat(ctx->curr_buf, anchor,
+                snprintf(anchor, sizeof(anchor), "#%u", (unsigned int)id)))
+      return 0;
+  }
+  return 2;
+}
+
+int write_link_url(struct mdview_ctx *ctx, char *url) {
+  if (!ctx->index || ctx->image_link || !is_local_url(url))
+    return bufcat(ctx->curr_buf, url, strlen(url));
+
+  struct mdview_buf key = {NULL, 0, 0};
+  int resolved = resolve_link(ctx, url, &key);
+  free(key.buf);
+  if (resolved == 2)
+    return 1;
+  return resolved && bufcat(ctx->curr_buf, url, strlen(url));
+}
+
+/*
+ * Index files
+ */
+
+int mdview_index_save(const struct mdview_index *index, const char *file) {
+  FILE *f = fopen(file, "wb");
+  if (!f) {
+    perror("fopen");
+    return 0;
+  }
+  int success = fwrite(index->data, 1, index->len, f) == index->len;
+  if (!success)
+    perror("fwrite");
+  if (fclose(f) == EOF) {
+    perror("fclose");
+    success = 0;
+  }
+  return success;
+}
+
+// Returns 1 if the data is a valid index.
+static int index_valid(const struct mdview_index *index) {
+  if (index->len < sizeof(struct index_header))
+    return 0;
+  const struct index_header *header = INDEX_HEADER(index);
+  if (memcmp(header->magic, INDEX_MAGIC, 4) != 0 ||
+      header->version != INDEX_VERSION || header->slots == 0 ||
+      (header->slots & (header->slots - 1)) != 0 ||
+      header->used >= header->slots)
+    return 0;
+  if ((index->len - sizeof(struct index_header)) / sizeof(struct index_slot) <
+          header->slots ||
+      index->len != sizeof(struct index_header) +
+                        header->slots * sizeof(struct index_slot) +
+                        header->keys_len)
+    return 0;
+
+  // every key must be inside of the file, and there must really be an empty
+  // slot, or looking up a key that isn't there would never stop
+  const struct index_slot *slots = INDEX_SLOTS(index);
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < header->slots; i++) {
+    if (slots[i].key > header->keys_len ||
+        slots[i].key_len > header->keys_len - slots[i].key)
+      return 0;
+    used += slots[i].key_len != 0;
+  }
+  return used == header->used;
+}
+
+int mdview_index_load(struct mdview_index *index, const char *file) {
+  index->data = NULL;
+  index->len = 0;
+  index->cap = 0;
+
+  int fd = open(file, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 0;
+  }
+
+  index->data = data;
+  index->len = st.st_size;
+  if (!index_valid(index)) {
+    mdview_index_free(index);
+    return 0;
+  }
+  return 1;
+}
+
+void mdview_index_free(struct mdview_index *index) {
+  if (index->cap == 0 && index->data)
+    munmap(index->data, index->len);
+  else
+    free(index->data);
+  index->data = NULL;
+  index->len = 0;
+  index->cap = 0;
+}
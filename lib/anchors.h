@@ -0,0 +1,12 @@
+#pragma once
+
+#include "mdview.h"
+
+// Add the heading that is being closed to the index in ctx->indexing. This is
+// called while a document is indexed by mdview_index_add().
+int index_heading(struct mdview_ctx *ctx);
+
+// Write the URL of a link. If ctx->index is set, then links to markdown
+// documents and their headings are rewritten to the HTML documents, and links
+// that don't resolve are added to ctx->broken_links.
+int write_link_url(struct mdview_ctx *ctx, char *url);
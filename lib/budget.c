@@ -0,0 +1,82 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "budget.h"
+#include "mdview.h"
+#include "util.h"
+#include <string.h>
+#include <time.h>
+
+// Bytes of markdown parsed between checks of the limits. Checking is cheap,
+// but not cheap enough to do for every character.
+#define SLICE_BYTES 4096
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int start_usage(struct mdview_ctx *ctx, struct feed_usage *usage) {
+  usage->start = ctx->time_budget_ms ? now_ns() : 0;
+  // runs of input from an earlier call to mdview_feed_iov() were already
+  // counted
+  usage->refs = ctx->scratch ? ctx->scratch->iov_refs_len : 0;
+  usage->ref_bytes = 0;
+  usage->held = 0;
+  return ctx->max_output || ctx->max_amplification || ctx->max_temp ||
+         ctx->time_budget_ms;
+}
+
+size_t slice_len(const char *md, size_t max) {
+  return strnlen(md, max < SLICE_BYTES ? max : SLICE_BYTES);
+}
+
+// Returns the number of bytes of HTML that the feed has generated so far,
+// including input that mdview_feed_iov() references instead of copying.
+static size_t feed_output(struct mdview_ctx *ctx, struct feed_usage *usage) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  size_t ref_bytes = usage->ref_bytes;
+  if (scratch && usage->refs < scratch->iov_refs_len) {
+    // the last run can still grow, so it is never added to ref_bytes
+    for (; usage->refs + 1 < scratch->iov_refs_len; usage->refs++)
+      usage->ref_bytes += scratch->iov_refs[usage->refs].len;
+    ref_bytes = usage->ref_bytes + scratch->iov_refs[usage->refs].len;
+  }
+  return ctx->html_out.len + ref_bytes - usage->held;
+}
+
+int check_limits(struct mdview_ctx *ctx, struct feed_usage *usage) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  size_t out = scratch->out_total + feed_output(ctx, usage);
+  if (ctx->max_output && out > ctx->max_output) {
+    ctx->error_msg = "output limit exceeded";
+    return 0;
+  }
+
+  // out > MDVIEW_OUTPUT_SLACK + in_total * max_amplification, without
+  // overflowing
+  if (ctx->max_amplification && out > MDVIEW_OUTPUT_SLACK &&
+      (out - MDVIEW_OUTPUT_SLACK - 1) / ctx->max_amplification >=
+          scratch->in_total) {
+    ctx->error_msg = "output amplification limit exceeded";
+    return 0;
+  }
+
+  if (ctx->max_temp &&
+      (ctx->temp_buf.len > ctx->max_temp ||
+       scratch->table_buf.len > ctx->max_temp)) {
+    ctx->error_msg = "pending markdown limit exceeded";
+    return 0;
+  }
+
+  if (ctx->time_budget_ms &&
+      now_ns() - usage->start > ctx->time_budget_ms * 1000000ull) {
+    ctx->error_msg = "time budget exceeded";
+    return 0;
+  }
+  return 1;
+}
+
+void count_output(struct mdview_ctx *ctx, struct feed_usage *usage) {
+  ctx->scratch->out_total += feed_output(ctx, usage);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "mdview.h"
+
+// What a feed has used so far, for checking it against the context's limits.
+struct feed_usage {
+  unsigned long long start; // when the feed started, in nanoseconds
+  size_t refs;      // number of the scratch space's iov_refs that are counted
+                    // in ref_bytes
+  size_t ref_bytes; // bytes of input in those runs
+  size_t held;      // bytes of html_out that were already counted when they
+                    // were held back for references
+};
+
+// Start keeping track of a feed. Returns 1 if any limits are set, and 0 if
+// there is nothing to check. The input and output are counted in the scratch
+// space, so it has to be allocated before the limits are checked.
+int start_usage(struct mdview_ctx *ctx, struct feed_usage *usage);
+
+// Returns the length of the markdown to parse before the limits are checked
+// again, which is at most max bytes.
+size_t slice_len(const char *md, size_t max);
+
+// Check the limits after a slice of markdown has been parsed. If one has been
+// exceeded, then ctx->error_msg is set and 0 is returned.
+int check_limits(struct mdview_ctx *ctx, struct feed_usage *usage);
+
+// Count the output of a feed that has finished towards the scratch space's
+// out_total.
+void count_output(struct mdview_ctx *ctx, struct feed_usage *usage);
@@ -0,0 +1,374 @@
+#include "highlight.h"
+#include "mdview.h"
+#include "util.h"
+#include <ctype.h>
+#include <string.h>
+
+// Languages that can be highlighted. 0 means no highlighting.
+enum { LANG_NONE, LANG_C, LANG_SH, LANG_JSON, LANG_PY };
+
+// Tokens the highlighter can be in.
+enum {
+  HL_NONE,     // between tokens
+  HL_WORD,     // a word that might be a keyword (buffered in hl_word)
+  HL_IDENT,    // a word too long to be a keyword
+  HL_NUM,      // a number
+  HL_STR,      // a string
+  HL_LINECOM,  // a comment that ends at the end of the line
+  HL_BLOCKCOM, // a C block comment
+  HL_SLASH,    // a '/' that might start a C comment
+  HL_PP,       // a C preprocessor line
+};
+
+/*
+ * Keyword tables
+ *
+ * Each table is a perfect hash of the language's keywords: no two keywords
+ * share a slot, so a lookup is one hash and at most one strcmp. The multipliers
+ * were found by brute force and must be regenerated if a keyword is added.
+ */
+
+static const char *const c_keywords[128] = {
+    [0] = "auto", [5] = "while", [8] = "_Bool", [12] = "const", [14] = "return",
+    [22] = "else", [26] = "void", [27] = "volatile", [28] = "register",
+    [31] = "default", [35] = "double", [38] = "goto", [39] = "unsigned",
+    [44] = "break", [48] = "case", [51] = "switch", [53] = "typedef",
+    [59] = "float", [60] = "continue", [65] = "_Complex", [67] = "for",
+    [69] = "sizeof", [70] = "_Imaginary", [75] = "extern", [78] = "enum",
+    [79] = "signed", [83] = "long", [84] = "static", [88] = "inline",
+    [91] = "if", [96] = "int", [98] = "restrict", [115] = "char", [117] = "do",
+    [120] = "union", [124] = "short", [127] = "struct",
+};
+
+static const char *const sh_keywords[64] = {
+    [3] = "readonly", [4] = "esac", [5] = "do", [6] = "until", [7] = "if",
+    [11] = "for", [17] = "done", [18] = "else", [20] = "case", [21] = "elif",
+    [24] = "continue", [25] = "while", [27] = "select", [28] = "function",
+    [29] = "local", [31] = "in", [33] = "time", [45] = "export", [52] = "break",
+    [54] = "return", [61] = "fi", [62] = "then",
+};
+
+static const char *const json_keywords[4] = {
+    [0] = "false",
+    [2] = "null",
+    [3] = "true",
+};
+
+static const char *const py_keywords[128] = {
+    [0] = "elif", [1] = "yield", [3] = "def", [5] = "break", [11] = "try",
+    [12] = "pass", [14] = "or", [16] = "nonlocal", [24] = "with",
+    [30] = "return", [33] = "while", [36] = "from", [43] = "for", [44] = "True",
+    [46] = "lambda", [51] = "del", [53] = "raise", [54] = "if", [58] = "global",
+    [65] = "class", [66] = "import", [68] = "None", [71] = "finally",
+    [73] = "async", [78] = "as", [91] = "not", [97] = "await", [98] = "assert",
+    [101] = "False", [103] = "and", [104] = "else", [110] = "is",
+    [114] = "except", [118] = "in", [124] = "continue",
+};
+
+struct hl_lang {
+  const char *const *keywords; // perfect hash table of keywords
+  unsigned int hash_a, hash_b; // multipliers of the first and last character
+  unsigned int hash_mask;      // size of the keyword table minus one
+  char line_comment;           // starts a comment to the end of the line
+  const char *quotes;          // characters that start a string
+  int c_like;                  // 1 = C comments and preprocessor lines
+  int multiline_str;           // 1 = strings may continue past a newline
+};
+
+static const struct hl_lang langs[] = {
+    [LANG_C] = {c_keywords, 15, 5, 127, 0, "\"'", 1, 0},
+    [LANG_SH] = {sh_keywords, 3, 5, 63, '#', "\"'", 0, 1},
+    [LANG_JSON] = {json_keywords, 1, 3, 3, 0, "\"", 0, 0},
+    [LANG_PY] = {py_keywords, 4, 24, 127, '#', "\"'", 0, 0},
+};
+
+// Info string names of each language.
+static const struct {
+  const char *name;
+  int lang;
+} lang_names[] = {
+    {"c", LANG_C},       {"h", LANG_C},      {"sh", LANG_SH},
+    {"bash", LANG_SH},   {"shell", LANG_SH}, {"zsh", LANG_SH},
+    {"json", LANG_JSON}, {"py", LANG_PY},    {"python", LANG_PY},
+};
+
+static int is_keyword(const struct hl_lang *lang, const char *word,
+                      size_t len) {
+  unsigned int h = ((unsigned char)word[0] * lang->hash_a) ^
+                   ((unsigned char)word[len - 1] * lang->hash_b) ^
+                   (unsigned int)len;
+  const char *kw = lang->keywords[h & lang->hash_mask];
+  return kw && strlen(kw) == len && memcmp(kw, word, len) == 0;
+}
+
+static inline int is_ident(char ch) {
+  return isalnum((unsigned char)ch) || ch == '_';
+}
+
+/*
+ * Code block info strings
+ */
+
+// Characters allowed in a language name. Anything else ends the name, so the
+// name never has to be escaped inside the class attribute.
+static inline int is_lang_char(char ch) {
+  return isalnum((unsigned char)ch) || strchr("-_+.#", ch);
+}
+
+int handle_code_info(struct mdview_ctx *ctx, char ch) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  if (ch == '\n') {
+    if (!end_code_info(ctx))
+      return 0;
+    ctx->hl_bol = 1;
+    return 1;
+  }
+
+  switch (ctx->code_info) {
+  case 1:
+    // skip whitespace before the language
+    if (ch == ' ' || ch == '\t')
+      return 1;
+    if (!is_lang_char(ch)) {
+      ctx->code_info = 3;
+      return 1;
+    }
+    if (!bufcat(ctx->curr_buf, " class=\"language-", 17))
+      return 0;
+    ctx->code_info = 2;
+    // fallthrough
+  case 2:
+    if (!is_lang_char(ch)) {
+      ctx->code_info = 3;
+      return 1;
+    }
+    // remember the start of the name, it might be a language we highlight
+    if (ctx->hl_word_len < sizeof(scratch->hl_word) - 1)
+      scratch->hl_word[ctx->hl_word_len++] = tolower((unsigned char)ch);
+    return bufadd(ctx->curr_buf, ch);
+  default:
+    // ignore everything after the language
+    return 1;
+  }
+}
+
+int end_code_info(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  if (!ctx->code_info)
+    return 1;
+  // the class attribute was opened if any of the language was read
+  if (ctx->hl_word_len > 0 && !bufadd(ctx->curr_buf, '"'))
+    return 0;
+  if (!bufadd(ctx->curr_buf, '>'))
+    return 0;
+
+  // pick a highlighter for the language, if we have one
+  scratch->hl_word[ctx->hl_word_len] = '\0';
+  ctx->code_lang = LANG_NONE;
+  if (ctx->highlight && ctx->hl_word_len > 0) {
+    for (size_t i = 0; i < sizeof(lang_names) / sizeof(lang_names[0]); i++) {
+      if (strcmp(scratch->hl_word, lang_names[i].name) == 0) {
+        ctx->code_lang = lang_names[i].lang;
+        break;
+      }
+    }
+  }
+
+  ctx->code_info = 0;
+  ctx->hl_state = HL_NONE;
+  ctx->hl_word_len = 0;
+  return 1;
+}
+
+/*
+ * Syntax highlighting
+ */
+
+// Write a character of code, rewriting characters that can't be written as-is.
+// This matches the rewrites of unhighlighted code blocks in handle_char().
+static int hl_putc(struct mdview_ctx *ctx, char ch) {
+  switch (ch) {
+  case '<':
+    return bufcat(ctx->curr_buf, "&lt;", 4);
+  case '>':
+    return bufcat(ctx->curr_buf, "&gt;", 4);
+  case '\\':
+    return bufcat(ctx->curr_buf, "&#92;", 5);
+  default:
+    return bufadd(ctx->curr_buf, ch);
+  }
+}
+
+// Open a span for a token and write its first character.
+#define OPEN_SPAN(cls, state, ch)                                              \
+  if (!bufcat(ctx->curr_buf, "<span class=\"hl-" cls "\">",                    \
+              18 + sizeof(cls) - 1) ||                                         \
+      !hl_putc(ctx, ch))                                                       \
+    return 0;                                                                  \
+  ctx->hl_state = state;                                                       \
+  return 1;
+
+static inline int close_span(struct mdview_ctx *ctx) {
+  ctx->hl_state = HL_NONE;
+  return bufcat(ctx->curr_buf, "</span>", 7);
+}
+
+// Write the buffered word, wrapped in a span if it is a keyword.
+static int flush_word(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  const struct hl_lang *lang = &langs[ctx->code_lang];
+  ctx->hl_state = HL_NONE;
+  if (is_keyword(lang, scratch->hl_word, ctx->hl_word_len)) {
+    return bufcat(ctx->curr_buf, "<span class=\"hl-kw\">", 20) &&
+           bufcat(ctx->curr_buf, scratch->hl_word, ctx->hl_word_len) &&
+           bufcat(ctx->curr_buf, "</span>", 7);
+  }
+  return bufcat(ctx->curr_buf, scratch->hl_word, ctx->hl_word_len);
+}
+
+// Handle a character between tokens.
+static int highlight_none(struct mdview_ctx *ctx, char ch) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  const struct hl_lang *lang = &langs[ctx->code_lang];
+  int bol = ctx->hl_bol;
+  if (ch == '\n')
+    ctx->hl_bol = 1;
+  else if (ch != ' ' && ch != '\t')
+    ctx->hl_bol = 0;
+
+  if (isalpha((unsigned char)ch) || ch == '_') {
+    scratch->hl_word[0] = ch;
+    ctx->hl_word_len = 1;
+    ctx->hl_state = HL_WORD;
+    return 1;
+  } else if (isdigit((unsigned char)ch)) {
+    OPEN_SPAN("num", HL_NUM, ch)
+  } else if (strchr(lang->quotes, ch)) {
+    scratch->hl_quote = ch;
+    scratch->hl_prev = 0;
+    OPEN_SPAN("str", HL_STR, ch)
+  } else if (lang->line_comment && ch == lang->line_comment &&
+             (bol || scratch->hl_prev == ' ' || scratch->hl_prev == '\t')) {
+    OPEN_SPAN("com", HL_LINECOM, ch)
+  } else if (lang->c_like && ch == '#' && bol) {
+    OPEN_SPAN("pp", HL_PP, ch)
+  } else if (lang->c_like && ch == '/') {
+    ctx->hl_state = HL_SLASH;
+    return 1;
+  }
+
+  scratch->hl_prev = ch;
+  return hl_putc(ctx, ch);
+}
+
+int highlight_char(struct mdview_ctx *ctx, char ch) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  const struct hl_lang *lang = &langs[ctx->code_lang];
+  int in_token = ctx->hl_state != HL_NONE;
+
+  // Characters that end a token fall through to highlight_none() so they can
+  // start the next one.
+  switch (ctx->hl_state) {
+  case HL_WORD:
+    if (is_ident(ch)) {
+      if (ctx->hl_word_len < sizeof(scratch->hl_word) - 1) {
+        scratch->hl_word[ctx->hl_word_len++] = ch;
+        return 1;
+      }
+      // too long to be a keyword, so stop buffering it
+      if (!bufcat(ctx->curr_buf, scratch->hl_word, ctx->hl_word_len))
+        return 0;
+      ctx->hl_state = HL_IDENT;
+      return bufadd(ctx->curr_buf, ch);
+    }
+    if (!flush_word(ctx))
+      return 0;
+    break;
+  case HL_IDENT:
+    if (is_ident(ch))
+      return bufadd(ctx->curr_buf, ch);
+    ctx->hl_state = HL_NONE;
+    break;
+  case HL_NUM:
+    if (is_ident(ch) || ch == '.')
+      return hl_putc(ctx, ch);
+    if (!close_span(ctx))
+      return 0;
+    break;
+  case HL_STR:
+    if (ch == '\n' && !lang->multiline_str) {
+      if (!close_span(ctx))
+        return 0;
+      break;
+    }
+    if (!hl_putc(ctx, ch))
+      return 0;
+    if (scratch->hl_prev == '\\' &&
+        !(ctx->code_lang == LANG_SH && scratch->hl_quote == '\'')) {
+      // this character is escaped
+      scratch->hl_prev = 0;
+      return 1;
+    }
+    scratch->hl_prev = ch;
+    if (ch == scratch->hl_quote)
+      return close_span(ctx);
+    return 1;
+  case HL_LINECOM:
+  case HL_PP:
+    if (ch == '\n') {
+      if (!close_span(ctx))
+        return 0;
+      break;
+    }
+    return hl_putc(ctx, ch);
+  case HL_BLOCKCOM:
+    if (!hl_putc(ctx, ch))
+      return 0;
+    if (scratch->hl_prev == '*' && ch == '/')
+      return close_span(ctx);
+    scratch->hl_prev = ch;
+    return 1;
+  case HL_SLASH:
+    if (ch == '/' || ch == '*') {
+      if (!bufcat(ctx->curr_buf, "<span class=\"hl-com\">/", 22) ||
+          !bufadd(ctx->curr_buf, ch))
+        return 0;
+      ctx->hl_state = ch == '/' ? HL_LINECOM : HL_BLOCKCOM;
+      scratch->hl_prev = 0;
+      return 1;
+    }
+    ctx->hl_state = HL_NONE;
+    if (!bufadd(ctx->curr_buf, '/'))
+      return 0;
+    break;
+  }
+
+  // the previous character was part of a token, so it wasn't whitespace
+  if (in_token)
+    scratch->hl_prev = 0;
+  return highlight_none(ctx, ch);
+}
+
+int highlight_end(struct mdview_ctx *ctx) {
+  int retval = 1;
+  switch (ctx->hl_state) {
+  case HL_WORD:
+    retval = flush_word(ctx);
+    break;
+  case HL_NUM:
+  case HL_STR:
+  case HL_LINECOM:
+  case HL_BLOCKCOM:
+  case HL_PP:
+    retval = close_span(ctx);
+    break;
+  case HL_SLASH:
+    retval = bufadd(ctx->curr_buf, '/');
+    break;
+  }
+
+  ctx->code_lang = LANG_NONE;
+  ctx->hl_state = HL_NONE;
+  ctx->hl_word_len = 0;
+  return retval;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "mdview.h"
+
+/*
+ * Code block info strings
+ */
+
+// Handle a character of a code block's info string (everything after the
+// opening fence up to the newline). The language is written as a
+// class="language-x" attribute and the opening <code> tag is finished on the
+// newline.
+int handle_code_info(struct mdview_ctx *ctx, char ch);
+
+// Finish the opening <code> tag if the info string was never ended.
+int end_code_info(struct mdview_ctx *ctx);
+
+/*
+ * Syntax highlighting
+ */
+
+// Highlight a single character of code. Tokens are wrapped in
+// <span class="hl-x"></span> elements where x is kw (keyword), str (string),
+// com (comment), num (number), or pp (preprocessor).
+int highlight_char(struct mdview_ctx *ctx, char ch);
+
+// End the current token, if any. This is called when a code block is closed.
+int highlight_end(struct mdview_ctx *ctx);
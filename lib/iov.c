@@ -0,0 +1,83 @@
+#include "iov.h"
+#include "mdview.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int iov_ref_input(struct mdview_ctx *ctx) {
+  const char *src = ctx->in_pos;
+  size_t at = ctx->html_out.len;
+  // the input character can only be referenced once
+  ctx->in_pos = NULL;
+  struct mdview_scratch *scratch = get_scratch(ctx);
+  if (!scratch)
+    return 0;
+
+  // extend the last run if this character comes right after it
+  if (scratch->iov_refs_len > 0) {
+    struct mdview_iov_ref *last =
+        &scratch->iov_refs[scratch->iov_refs_len - 1];
+    if (last->at == at && last->src + last->len == src) {
+      last->len++;
+      return 1;
+    }
+  }
+
+  if (scratch->iov_refs_len == scratch->iov_refs_cap) {
+    size_t cap = scratch->iov_refs_cap ? scratch->iov_refs_cap * 2 : 64;
+    struct mdview_iov_ref *tmp =
+        realloc(scratch->iov_refs, cap * sizeof(struct mdview_iov_ref));
+    if (!tmp) {
+      perror("realloc");
+      return 0;
+    }
+    scratch->iov_refs = tmp;
+    scratch->iov_refs_cap = cap;
+  }
+  scratch->iov_refs[scratch->iov_refs_len].at = at;
+  scratch->iov_refs[scratch->iov_refs_len].src = src;
+  scratch->iov_refs[scratch->iov_refs_len].len = 1;
+  scratch->iov_refs_len++;
+  return 1;
+}
+
+struct iovec *iov_build(struct mdview_ctx *ctx, int *iovcnt) {
+  struct mdview_scratch *scratch = get_scratch(ctx);
+  if (!scratch)
+    return NULL;
+
+  // each run of input can split html_out in two
+  size_t cap = scratch->iov_refs_len * 2 + 1;
+  if (cap > scratch->iov_cap) {
+    struct iovec *tmp = realloc(scratch->iov, cap * sizeof(struct iovec));
+    if (!tmp) {
+      perror("realloc");
+      return NULL;
+    }
+    scratch->iov = tmp;
+    scratch->iov_cap = cap;
+  }
+
+  // html_out can only be pointed into now that it is done growing
+  size_t cnt = 0, at = 0;
+  for (size_t i = 0; i < scratch->iov_refs_len; i++) {
+    struct mdview_iov_ref *ref = &scratch->iov_refs[i];
+    if (ref->at > at) {
+      scratch->iov[cnt].iov_base = ctx->html_out.buf + at;
+      scratch->iov[cnt].iov_len = ref->at - at;
+      cnt++;
+      at = ref->at;
+    }
+    scratch->iov[cnt].iov_base = (void *)ref->src;
+    scratch->iov[cnt].iov_len = ref->len;
+    cnt++;
+  }
+  if (ctx->html_out.len > at) {
+    scratch->iov[cnt].iov_base = ctx->html_out.buf + at;
+    scratch->iov[cnt].iov_len = ctx->html_out.len - at;
+    cnt++;
+  }
+
+  *iovcnt = cnt;
+  return scratch->iov;
+}
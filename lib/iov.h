@@ -0,0 +1,12 @@
+#pragma once
+
+#include "mdview.h"
+
+// Write the input character in ctx->in_pos to html_out by referencing it
+// instead of copying it. This is used for plain text while mdview_feed_iov()
+// is feeding markdown.
+int iov_ref_input(struct mdview_ctx *ctx);
+
+// Build the iovecs of html_out and the input it references. Returns NULL on
+// error.
+struct iovec *iov_build(struct mdview_ctx *ctx, int *iovcnt);
@@ -1,10 +1,17 @@
 #include "links.h"
 #include "mdview.h"
 #include "parser.h"
+#include "refs.h"
 #include "tags.h"
 #include "util.h"
 #include <string.h>
 
+// Returns 1 if the text part of a link has ended with a ']'.
+static int link_text_done(struct mdview_ctx *ctx) {
+  return ctx->temp_buf.len > 0 &&
+         ctx->temp_buf.buf[ctx->temp_buf.len - 1] == '\0';
+}
+
 // 0 means error, -1 = success but no link handled, 1 = success and link handled
 int handle_link_special_char(struct mdview_ctx *ctx, char ch) {
   switch (ch) {
@@ -13,6 +20,7 @@ int handle_link_special_char(struct mdview_ctx *ctx, char ch) {
     if (!ctx->pending_link) {
       ctx->curr_buf = &ctx->temp_buf;
       ctx->image_link = 1;
+      ctx->slow_path = 1;
       return 1;
     }
     break;
@@ -24,27 +32,48 @@ int handle_link_special_char(struct mdview_ctx *ctx, char ch) {
       else
         ctx->curr_buf = &ctx->temp_buf;
       ctx->pending_link = 1;
+      ctx->slow_path = 1;
+      // only a link that starts a line outside of any block can be a
+      // reference definition
+      ctx->link_def =
+          ctx->line_start && ctx->block_type == -1 && !ctx->image_link;
+      return 1;
+    }
+    // "[text][" starts the label of a reference link
+    if (ctx->pending_link == 1 && link_text_done(ctx)) {
+      ctx->pending_link = 3;
       return 1;
     }
     break;
   case ']':
-    // end of the text part.
+    // end of the text part, or of a reference link as a whole.
+    if (ctx->pending_link == 3)
+      return bufadd(&ctx->temp_buf, '\0') && end_link(ctx);
     if (ctx->pending_link)
       return bufadd(&ctx->temp_buf, '\0');
     break;
+  case ':':
+    // "[label]:" defines a reference. the rest of the line is handled by
+    // ref_def_char().
+    if (ctx->pending_link == 1 && ctx->link_def && ctx->block_type == -1 &&
+        link_text_done(ctx)) {
+      ctx->pending_link = 4;
+      return 1;
+    }
+    break;
   case '(':
     // beginning of the URL part. Note: there might be characters between the
     // ']' and the '(' that invalidate the link, so this case and the previous
     // one must be separate. hangle_regular_char() will prematurely end the
     // link if it encounters a character that isn't part of a link.
-    if (ctx->pending_link) {
+    if (ctx->pending_link == 1 || ctx->pending_link == 2) {
       ctx->pending_link = 2;
       return 1;
     }
     break;
   case ')':
     // end of the URL part, and the link as a whole. end the link and write it.
-    if (ctx->pending_link) {
+    if (ctx->pending_link == 1 || ctx->pending_link == 2) {
       if (!bufadd(&ctx->temp_buf, '\0'))
         return 0;
       return end_link(ctx);
@@ -52,16 +81,31 @@ int handle_link_special_char(struct mdview_ctx *ctx, char ch) {
     break;
   }
 
+  if (!end_image_link(ctx))
+    return 0;
+  return -1;
+}
+
+int end_image_link(struct mdview_ctx *ctx) {
   // we had previously predicted an image link, but turns out its not. now we
   // have to print "!"
   if (ctx->image_link && !ctx->pending_link) {
     ctx->curr_buf = &ctx->html_out;
     ctx->image_link = 0;
-    if (!handle_regular_char(ctx, '!'))
+    return handle_regular_char(ctx, '!');
+  }
+  return 1;
+}
+
+// Write part of the temporary buffer as regular text. A ']' is buffered as a
+// '\0', so it is written as a ']' again.
+static int write_buffered(struct mdview_ctx *ctx, size_t start, size_t len) {
+  for (size_t i = start; i < start + len; i++) {
+    char ch = ctx->temp_buf.buf[i];
+    if (!bufadd(&ctx->html_out, ch ? ch : ']'))
       return 0;
   }
-  
-  return -1;
+  return 1;
 }
 
 int end_link(struct mdview_ctx *ctx) {
@@ -69,34 +113,67 @@ int end_link(struct mdview_ctx *ctx) {
   if (!ctx->pending_link)
     return 1;
 
+  // a reference definition is stored instead of written, unless it has no URL
+  if (ctx->pending_link >= 4) {
+    char *url = ctx->temp_buf.buf + strlen(ctx->temp_buf.buf) + 1;
+    if (*url) {
+      if (!add_ref_def(ctx, ctx->temp_buf.buf, url))
+        return 0;
+      goto end;
+    }
+  }
+  if (!open_text(ctx))
+    return 0;
+
   // if we haven't finished the link, then just write the text as regular
-  if (ctx->temp_buf.len == 0)
-    return bufadd(&ctx->html_out, '[');
+  if (ctx->temp_buf.len == 0) {
+    if (!bufadd(&ctx->html_out, '['))
+      return 0;
+    goto end;
+  }
   char last_char = ctx->temp_buf.buf[ctx->temp_buf.len - 1];
   if (ctx->pending_link == 1) {
     if (!bufadd(&ctx->html_out, '['))
       return 0;
 
-    if (last_char == '\0') {
-      // ended text, but before the URL
-      if (!bufcat(&ctx->html_out, ctx->temp_buf.buf, ctx->temp_buf.len - 1) ||
-          !bufadd(&ctx->html_out, ']'))
-        return 0;
-      goto end;
-    } else {
-      // ended in the middle of the text
-      if (!bufcat(&ctx->html_out, ctx->temp_buf.buf, ctx->temp_buf.len))
-        return 0;
-      goto end;
-    }
+    // ended in the middle of the text, or after it but before the URL
+    if (!write_buffered(ctx, 0, ctx->temp_buf.len))
+      return 0;
+    goto end;
   } else if (ctx->pending_link == 2 && last_char != '\0') {
     // ended in the middle of the URL
     size_t text_len = strlen(ctx->temp_buf.buf);
     if (!bufadd(&ctx->html_out, '[') ||
         !bufcat(&ctx->html_out, ctx->temp_buf.buf, text_len) ||
         !bufcat(&ctx->html_out, "](", 2) ||
-        !bufcat(&ctx->html_out, ctx->temp_buf.buf + text_len + 1,
-                ctx->temp_buf.len - text_len - 1))
+        !write_buffered(ctx, text_len + 1, ctx->temp_buf.len - text_len - 1))
+      return 0;
+    goto end;
+  } else if (ctx->pending_link == 3) {
+    // The text and the label are consecutive strings, like the text and URL
+    // of other links.
+    size_t text_len = strlen(ctx->temp_buf.buf);
+    if (ctx->temp_buf.len > text_len + 1 && last_char == '\0') {
+      ctx->curr_buf = &ctx->html_out;
+      if (!write_ref_link(ctx, ctx->temp_buf.buf,
+                          ctx->temp_buf.buf + text_len + 1))
+        return 0;
+      goto end;
+    }
+
+    // ended in the middle of the label
+    if (!bufadd(&ctx->html_out, '[') ||
+        !bufcat(&ctx->html_out, ctx->temp_buf.buf, text_len) ||
+        !bufcat(&ctx->html_out, "][", 2) ||
+        !write_buffered(ctx, text_len + 1, ctx->temp_buf.len - text_len - 1))
+      return 0;
+    goto end;
+  } else if (ctx->pending_link >= 4) {
+    // a definition without a URL is regular text
+    if (!bufadd(&ctx->html_out, '[') ||
+        !bufcat(&ctx->html_out, ctx->temp_buf.buf,
+                strlen(ctx->temp_buf.buf)) ||
+        !bufcat(&ctx->html_out, "]:", 2))
       return 0;
     goto end;
   }
@@ -118,5 +195,185 @@ end:
   bufclear(&ctx->temp_buf);
   ctx->pending_link = 0;
   ctx->image_link = 0;
+  ctx->link_def = 0;
+  return 1;
+}
+
+int ref_def_char(struct mdview_ctx *ctx, char ch) {
+  // the definition ends with its line
+  if (ch == '\n')
+    return end_link(ctx) && handle_char(ctx, ch);
+
+  // whitespace before the URL is skipped, and whitespace after it ends it.
+  // anything after the URL (ie: a title) is ignored.
+  if (ctx->pending_link == 5)
+    return 1;
+  if (ch == ' ' || ch == '\t' || ch == '\r') {
+    if (!link_text_done(ctx))
+      ctx->pending_link = 5;
+    return 1;
+  }
+  return bufadd(&ctx->temp_buf, ch);
+}
+
+/*
+ * Autolinks
+ */
+
+// Prefixes that start a bare URL. A URL is only linked if something follows
+// its prefix.
+static const char *const autolink_prefixes[] = {"http://", "https://",
+                                                "www."};
+#define AUTOLINK_PREFIXES                                                      \
+  (sizeof(autolink_prefixes) / sizeof(autolink_prefixes[0]))
+
+// Characters that can be part of a bare URL (RFC 3986, plus any non-ASCII
+// byte). Anything else, like whitespace, '<', or '"', ends the URL.
+static const unsigned char url_chars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+    0, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x20
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, // 0x30
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, // 0x50
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, // 0x70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xC0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xD0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xE0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xF0
+};
+
+// Characters that end a sentence rather than a URL. They are removed from the
+// end of a URL and handled as regular markdown.
+#define URL_TRAILING "?!.,:*_~'"
+
+// Longest run of trailing characters that is removed from a URL. Anything
+// before it stays part of the URL.
+#define URL_TRAILING_MAX 16
+
+int autolink_candidate(struct mdview_ctx *ctx, char ch) {
+  // a character that was buffered can't be looked ahead of
+  if (!ctx->in_pos || *ctx->in_pos != ch)
+    return 1;
+
+  size_t avail = ctx->in_end - ctx->in_pos;
+  for (size_t i = 0; i < AUTOLINK_PREFIXES; i++) {
+    size_t len = strlen(autolink_prefixes[i]);
+    // the prefix might continue in the next feed
+    if (memcmp(ctx->in_pos, autolink_prefixes[i], len < avail ? len : avail) ==
+        0)
+      return 1;
+  }
+  return 0;
+}
+
+int start_autolink(struct mdview_ctx *ctx, char ch) {
+  ctx->autolink = 1;
+  ctx->slow_path = 1;
+  bufclear(&ctx->temp_buf);
+  return bufadd(&ctx->temp_buf, ch);
+}
+
+// Returns the length of the prefix the buffered URL starts with, or 0 if it
+// doesn't start with a complete prefix.
+static size_t autolink_prefix_len(struct mdview_ctx *ctx) {
+  for (size_t i = 0; i < AUTOLINK_PREFIXES; i++) {
+    size_t len = strlen(autolink_prefixes[i]);
+    if (ctx->temp_buf.len >= len &&
+        strncmp(ctx->temp_buf.buf, autolink_prefixes[i], len) == 0)
+      return len;
+  }
+  return 0;
+}
+
+int autolink_char(struct mdview_ctx *ctx, char ch) {
+  if (ctx->autolink == 1) {
+    // keep reading the prefix as long as it matches one of the prefixes
+    size_t len = ctx->temp_buf.len;
+    for (size_t i = 0; i < AUTOLINK_PREFIXES; i++) {
+      const char *prefix = autolink_prefixes[i];
+      if (strncmp(ctx->temp_buf.buf, prefix, len) == 0 && prefix[len] == ch) {
+        if (prefix[len + 1] == '\0')
+          ctx->autolink = 2;
+        return bufadd(&ctx->temp_buf, ch);
+      }
+    }
+  } else if (url_chars[(unsigned char)ch]) {
+    return bufadd(&ctx->temp_buf, ch);
+  }
+
+  // this character isn't part of the URL, so handle it regularly
+  if (!end_autolink(ctx))
+    return 0;
+  return handle_char(ctx, ch);
+}
+
+int end_autolink(struct mdview_ctx *ctx) {
+  if (!ctx->autolink)
+    return 1;
+  ctx->autolink = 0;
+
+  size_t prefix_len = autolink_prefix_len(ctx);
+  size_t len = ctx->temp_buf.len;
+  if (prefix_len == 0) {
+    // not a URL after all, so write what was buffered as regular text
+    ctx->last_ch = ctx->temp_buf.buf[len - 1];
+    if (!bufcat(&ctx->html_out, ctx->temp_buf.buf, len))
+      return 0;
+    bufclear(&ctx->temp_buf);
+    return 1;
+  }
+
+  // remove trailing punctuation, and closing parentheses that weren't opened
+  // in the URL
+  int parens = 0;
+  for (size_t i = 0; i < len; i++)
+    parens += (ctx->temp_buf.buf[i] == '(') - (ctx->temp_buf.buf[i] == ')');
+  size_t url_len = len;
+  while (url_len > prefix_len && len - url_len < URL_TRAILING_MAX) {
+    char last = ctx->temp_buf.buf[url_len - 1];
+    if (last == ')' && parens < 0)
+      parens++;
+    else if (!strchr(URL_TRAILING, last))
+      break;
+    url_len--;
+  }
+  char tail[URL_TRAILING_MAX];
+  size_t tail_len = len - url_len;
+  memcpy(tail, ctx->temp_buf.buf + url_len, tail_len);
+
+  if (url_len == prefix_len) {
+    // there is nothing after the prefix
+    ctx->last_ch = ctx->temp_buf.buf[url_len - 1];
+    if (!bufcat(&ctx->html_out, ctx->temp_buf.buf, url_len))
+      return 0;
+  } else {
+    // The buffer becomes the text, a '\0', and then the URL, like links.
+    // "www." URLs get a scheme.
+    ctx->temp_buf.len = url_len;
+    if (!bufadd(&ctx->temp_buf, '\0'))
+      return 0;
+    if (ctx->temp_buf.buf[0] == 'w' && !bufcat(&ctx->temp_buf, "http://", 7))
+      return 0;
+    for (size_t i = 0; i < url_len; i++) {
+      if (!bufadd(&ctx->temp_buf, ctx->temp_buf.buf[i]))
+        return 0;
+    }
+    ctx->last_ch = ctx->temp_buf.buf[url_len - 1];
+    if (!write_link(ctx, ctx->temp_buf.buf + url_len + 1, ctx->temp_buf.buf))
+      return 0;
+  }
+  bufclear(&ctx->temp_buf);
+
+  // the removed characters might be markdown, ie: the end of bold text
+  for (size_t i = 0; i < tail_len; i++) {
+    if (!handle_char(ctx, tail[i]))
+      return 0;
+  }
   return 1;
 }
@@ -4,7 +4,33 @@
 
 int handle_link_special_char(struct mdview_ctx *ctx, char ch);
 
+// End an image link that was predicted from a '!', if no '[' followed it. The
+// '!' is written as a regular character.
+int end_image_link(struct mdview_ctx *ctx);
+
 // End a link. If it is valid, then write the HTMl to the buffer. If it is
 // invalid, then write the special characters to the buffer as regular
 // characters.
 int end_link(struct mdview_ctx *ctx);
+
+// Handle a character of a reference definition's URL, or of the rest of its
+// line. Definitions are stored when their line ends (see refs.h).
+int ref_def_char(struct mdview_ctx *ctx, char ch);
+
+// Returns 0 if the word that starts with the character being handled can't be
+// a bare URL. The rest of the word is checked in the markdown that was fed, if
+// it is there, so that ordinary words aren't buffered.
+int autolink_candidate(struct mdview_ctx *ctx, char ch);
+
+// Start buffering a possible bare URL (ie: https://example.com or
+// www.example.com). This is called for an 'h' or 'w' at the start of a word.
+int start_autolink(struct mdview_ctx *ctx, char ch);
+
+// Handle a character while a possible bare URL is being buffered. The buffer
+// only grows while the characters still match one of the URL prefixes, or are
+// part of a URL after a complete prefix.
+int autolink_char(struct mdview_ctx *ctx, char ch);
+
+// End a bare URL. If it is valid, then write it as a link. Otherwise, write the
+// buffered characters as regular text.
+int end_autolink(struct mdview_ctx *ctx);
@@ -1,20 +1,28 @@
 #include "mdview.h"
+#include "budget.h"
+#include "iov.h"
 #include "links.h"
 #include "parser.h"
+#include "refs.h"
+#include "tables.h"
 #include "tags.h"
+#include "utf8.h"
 #include "util.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Returned instead of a buffer that was never allocated.
+static char empty_html[1];
+
 int mdview_init(struct mdview_ctx *ctx) {
   ctx->error_msg = NULL;
 
-  // setup the HTML buffer
-  ctx->html_out.buf = malloc(BUFSIZ);
-  ctx->html_out.buf[0] = '\0';
+  // setup the HTML buffer. it is only allocated once HTML is written to it.
+  ctx->html_out.buf = NULL;
   ctx->html_out.len = 0;
-  ctx->html_out.cap = BUFSIZ;
+  ctx->html_out.cap = 0;
 
   // setup the temporary buffer
   ctx->temp_buf.buf = NULL;
@@ -24,28 +32,133 @@ int mdview_init(struct mdview_ctx *ctx) {
   // set the default buffer to the HTML buffer
   ctx->curr_buf = &ctx->html_out;
 
+  // setup the provisional output buffers. they are only allocated if used.
+  ctx->provisional = 0;
+  ctx->tail_out.buf = NULL;
+  ctx->tail_out.len = 0;
+  ctx->tail_out.cap = 0;
+
+  // setup limits
+  ctx->max_output = 0;
+  ctx->max_amplification = 0;
+  ctx->max_temp = 0;
+  ctx->time_budget_ms = 0;
+
+  // setup input validation state
+  ctx->utf8_policy = 0;
+  ctx->utf8_len = 0;
+  ctx->utf8_need = 0;
+
   // setup parsing state
   ctx->feeds = 0;
+  ctx->slow_path = 0;
   ctx->special_cnt = 0;
   ctx->special_type = 0;
   ctx->line_start = 1;
+  ctx->line_depth = 0;
+  ctx->list_num = 0;
   ctx->id_cnt = 0;
 
   // setup decorations state
   ctx->block_type = -1;
   ctx->block_subtype = 0;
+  ctx->block_depth = 0;
   ctx->indent = 0;
   ctx->escaped = 0;
   ctx->text_decoration = 0;
 
+  // setup code block state
+  ctx->highlight = 0;
+  ctx->code_info = 0;
+  ctx->code_lang = 0;
+  ctx->hl_state = 0;
+  ctx->hl_bol = 0;
+  ctx->hl_word_len = 0;
+
+  // setup table state
+  ctx->table_pending = 0;
+  ctx->table_cell = 0;
+
   // setup link state
   ctx->pending_link = 0;
   ctx->image_link = 0;
+  ctx->link_def = 0;
+  ctx->autolink = 0;
+  ctx->last_ch = 0;
+  ctx->in_pos = NULL;
+  ctx->in_end = NULL;
+
+  // setup reference link state. it is only allocated once a reference is seen.
+  ctx->ref_defer = 0;
+  ctx->refs = NULL;
 
-  return 0;
+  // setup cross-document link state
+  ctx->index = NULL;
+  ctx->doc_path = NULL;
+  ctx->broken_links.buf = NULL;
+  ctx->broken_links.len = 0;
+  ctx->broken_links.cap = 0;
+  ctx->indexing = NULL;
+  ctx->heading_start = 0;
+
+  // setup zero-copy output state
+  ctx->iov_feed = 0;
+
+  // the scratch space is only allocated if it is used
+  ctx->scratch = NULL;
+
+  return 1;
 }
 
-char *mdview_feed(struct mdview_ctx *ctx, const char *md) {
+// End everything that is still pending. This is shared by mdview_flush() and
+// mdview_provisional().
+static int flush_pending(struct mdview_ctx *ctx) {
+  // end any code point that was cut off
+  if (!end_utf8(ctx))
+    return 0;
+
+  // end any pending table or bare URL
+  if (!end_table_pending(ctx) || !end_autolink(ctx))
+    return 0;
+
+  // end any pending special sequences
+  if (!end_special_sequence(ctx, 0))
+    return 0;
+
+  // end any pending links
+  if (!end_image_link(ctx) || !end_link(ctx))
+    return 0;
+
+  // end all decorations
+  if (!end_all_decorations(ctx))
+    return 0;
+
+  // end all blocks
+  return close_all_blocks(ctx);
+}
+
+// End everything that is still pending, and write out the output that was held
+// back for references. The limits are checked after each, like they are after
+// each slice of a feed. This is shared by mdview_flush() and feed().
+static int flush_all(struct mdview_ctx *ctx, struct feed_usage *usage,
+                     int limited) {
+  if (!flush_pending(ctx) || (limited && !check_limits(ctx, usage)))
+    return 0;
+  // the held back output was counted when it was generated
+  usage->held = ref_held_len(ctx);
+  if (!ref_flush(ctx) || (limited && !check_limits(ctx, usage)))
+    return 0;
+  if (limited)
+    count_output(ctx, usage);
+  return 1;
+}
+
+// Feed up to len bytes of markdown to the parser, stopping early at a NUL. If
+// flush is set, then everything that is still pending is ended too. This is
+// shared by mdview_feed(), mdview_feed_iov(), and mdview_render_range().
+// Returns 0 on error, 1 on success.
+static int feed(struct mdview_ctx *ctx, const char *md, size_t len,
+                int flush) {
   // reset the HTML buffer from the last feed, if this is not the first feed
   if (ctx->feeds > 0) {
     bufclear(&ctx->html_out);
@@ -53,14 +166,73 @@ char *mdview_feed(struct mdview_ctx *ctx, const char *md) {
   }
   ctx->feeds++;
 
-  // parse the markdown char by char
-  while (*md) {
-    if (!handle_char(ctx, *md))
-      return NULL;
-    md++;
+  // parse the markdown char by char, validating it first if asked to. if there
+  // are limits, then they are checked after each slice of it, and the input
+  // and output are counted in the scratch space.
+  struct feed_usage usage;
+  int limited = start_usage(ctx, &usage);
+  if (limited && !get_scratch(ctx))
+    return 0;
+  while (len > 0 && *md) {
+    size_t slice = slice_len(md, len);
+    ctx->in_end = md + slice;
+    if (ctx->utf8_policy) {
+      if (!utf8_feed(ctx, md, slice))
+        return 0;
+      md += slice;
+    } else {
+      for (; md < ctx->in_end; md++) {
+        ctx->in_pos = md;
+        if (!handle_char(ctx, *md))
+          return 0;
+      }
+    }
+    len -= slice;
+    if (limited) {
+      ctx->scratch->in_total += slice;
+      if (!check_limits(ctx, &usage))
+        return 0;
+    }
   }
+  ctx->in_pos = NULL;
+
+  // end everything, and write out the output that was held back for
+  // references
+  if (flush)
+    return flush_all(ctx, &usage, limited);
+  if (limited)
+    count_output(ctx, &usage);
+
+  // hold back output that has placeholders for references
+  if (!ref_feed_end(ctx))
+    return 0;
+
+  // render what is still pending, if the user asked for it
+  if (ctx->provisional && !mdview_provisional(ctx))
+    return 0;
+  return 1;
+}
+
+char *mdview_feed(struct mdview_ctx *ctx, const char *md) {
+  if (!feed(ctx, md, SIZE_MAX, 0))
+    return NULL;
+  return ctx->html_out.buf ? ctx->html_out.buf : empty_html;
+}
 
-  return ctx->html_out.buf;
+struct iovec *mdview_feed_iov(struct mdview_ctx *ctx, const char *md,
+                              int *iovcnt) {
+  // output that is held back for references is copied, so input can only be
+  // referenced while there aren't any placeholders
+  ctx->iov_feed = !ref_pending(ctx);
+  ctx->slow_path |= ctx->iov_feed;
+  if (ctx->scratch)
+    ctx->scratch->iov_refs_len = 0;
+  int success = feed(ctx, md, SIZE_MAX, 0);
+  ctx->iov_feed = 0;
+  ctx->in_pos = NULL;
+  if (!success)
+    return NULL;
+  return iov_build(ctx, iovcnt);
 }
 
 char *mdview_flush(struct mdview_ctx *ctx) {
@@ -69,23 +241,135 @@ char *mdview_flush(struct mdview_ctx *ctx) {
     ctx->error_msg = NULL;
   }
 
-  // end any pending special sequences
-  if (!end_special_sequence(ctx, 0))
+  struct feed_usage usage;
+  int limited = start_usage(ctx, &usage);
+  if ((limited && !get_scratch(ctx)) || !flush_all(ctx, &usage, limited))
     return NULL;
 
-  // end any pending special sequences
-  if (!end_link(ctx))
+  return ctx->html_out.buf ? ctx->html_out.buf : empty_html;
+}
+
+char *mdview_provisional(struct mdview_ctx *ctx) {
+  // Flush a shallow copy of the context. The copy writes into the tail buffers
+  // instead of the real ones, and has its own copy of the scratch space, so
+  // the real state is never changed.
+  struct mdview_scratch *scratch = get_scratch(ctx);
+  if (!scratch)
+    return NULL;
+  struct mdview_scratch copy_scratch = *scratch;
+  struct mdview_ctx copy = *ctx;
+  copy.scratch = &copy_scratch;
+  copy.html_out = ctx->tail_out;
+  copy.temp_buf = scratch->tail_temp;
+  copy_scratch.table_buf = scratch->tail_table;
+  // links that are still pending are only reported once they are flushed
+  copy.broken_links.buf = NULL;
+  copy.broken_links.len = 0;
+  copy.broken_links.cap = 0;
+  bufclear(&copy.html_out);
+  bufclear(&copy.temp_buf);
+  bufclear(&copy_scratch.table_buf);
+  if (ctx->temp_buf.len > 0 &&
+      !bufcat(&copy.temp_buf, ctx->temp_buf.buf, ctx->temp_buf.len))
     return NULL;
+  if (scratch->table_buf.len > 0 &&
+      !bufcat(&copy_scratch.table_buf, scratch->table_buf.buf,
+              scratch->table_buf.len))
+    return NULL;
+  copy.curr_buf =
+      ctx->curr_buf == &ctx->temp_buf ? &copy.temp_buf : &copy.html_out;
+  // a reference definition that is still being read doesn't write anything,
+  // and isn't defined until it is flushed. without a URL yet, it is written as
+  // text like it would be by mdview_flush().
+  if (copy.pending_link >= 4 &&
+      copy.temp_buf.buf[strlen(copy.temp_buf.buf) + 1] != '\0') {
+    copy.pending_link = 0;
+    copy.curr_buf = &copy.html_out;
+  }
+  // placeholders can't be added for references that are flushed here
+  copy.ref_defer = 0;
+  // a code point that was cut off isn't shown until the rest of it is fed
+  copy.utf8_len = 0;
 
-  // end all decorations
-  if (!end_all_decorations(ctx))
+  int success = flush_pending(&copy);
+  free(copy.broken_links.buf);
+  // the copy shares the reference state, unless it had to allocate its own
+  if (!ctx->refs)
+    ref_free(&copy);
+
+  // keep the (possibly reallocated) tail buffers around for the next call
+  ctx->tail_out = copy.html_out;
+  scratch->tail_temp = copy.temp_buf;
+  scratch->tail_table = copy_scratch.table_buf;
+  ctx->error_msg = copy.error_msg;
+  if (!success)
+    return NULL;
+
+  return ctx->tail_out.buf ? ctx->tail_out.buf : empty_html;
+}
+
+char *mdview_render_range(struct mdview_ctx *ctx, const char *md,
+                          const struct mdview_sections *sections,
+                          size_t section) {
+  if (ctx->feeds > 0) {
+    ctx->error_msg = "context has already been fed";
+    return NULL;
+  }
+  if (section >= sections->len) {
+    ctx->error_msg = "no such section";
     return NULL;
+  }
 
-  // end the last block
-  if (!close_block(ctx))
+  // the headings before the section are counted, as if they had been rendered
+  const struct mdview_section *range = &sections->sections[section];
+  ctx->id_cnt = range->id - 1;
+  if (!feed(ctx, md + range->start, range->end - range->start, 1))
     return NULL;
+  return ctx->html_out.buf ? ctx->html_out.buf : empty_html;
+}
+
+// Free a buffer's memory. It is allocated again if it is written to.
+static void release_buf(struct mdview_buf *buf) {
+  free(buf->buf);
+  buf->buf = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
 
-  return ctx->html_out.buf;
+// Free the scratch space, unless it holds state that is still needed. Then
+// only the buffers that aren't in use are freed.
+static void release_scratch(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  if (!scratch || !scratch_in_use(ctx)) {
+    free_scratch(ctx);
+    return;
+  }
+  release_buf(&scratch->tail_temp);
+  release_buf(&scratch->tail_table);
+  if (scratch->table_buf.len == 0)
+    release_buf(&scratch->table_buf);
+  free(scratch->iov_refs);
+  scratch->iov_refs = NULL;
+  scratch->iov_refs_len = 0;
+  scratch->iov_refs_cap = 0;
+  free(scratch->iov);
+  scratch->iov = NULL;
+  scratch->iov_cap = 0;
+}
+
+void mdview_release(struct mdview_ctx *ctx) {
+  // the output has already been returned, and the provisional buffers are
+  // only scratch space
+  release_buf(&ctx->html_out);
+  release_buf(&ctx->tail_out);
+  release_scratch(ctx);
+
+  // buffers that hold pending markdown are kept while they are in use
+  if (ctx->temp_buf.len == 0)
+    release_buf(&ctx->temp_buf);
+  if (ctx->broken_links.len == 0)
+    release_buf(&ctx->broken_links);
+  ref_release(ctx);
 }
 
 void mdview_free(struct mdview_ctx *ctx) {
@@ -100,4 +384,20 @@ void mdview_free(struct mdview_ctx *ctx) {
   free(ctx->temp_buf.buf);
   ctx->temp_buf.len = 0;
   ctx->temp_buf.cap = 0;
+
+  // free the provisional output buffers
+  free(ctx->tail_out.buf);
+  ctx->tail_out.len = 0;
+  ctx->tail_out.cap = 0;
+
+  // free the scratch space, along with the table buffer
+  free_scratch(ctx);
+
+  // free the list of broken links
+  free(ctx->broken_links.buf);
+  ctx->broken_links.len = 0;
+  ctx->broken_links.cap = 0;
+
+  // free the reference definitions and placeholders
+  ref_free(ctx);
 }
@@ -1,6 +1,15 @@
 #pragma once
 
 #include <stddef.h>
+#include <sys/uio.h>
+
+// Maximum number of blocks (lists and quotes) that can contain the current
+// block. Anything nested deeper is flattened.
+#define MDVIEW_BLOCK_DEPTH 8
+
+// Bytes of HTML that can be generated before ctx->max_amplification applies,
+// so that short input can still open and close a few blocks.
+#define MDVIEW_OUTPUT_SLACK 1024
 
 struct mdview_buf {
   char *buf;
@@ -8,42 +17,196 @@ struct mdview_buf {
   size_t cap;
 };
 
+// Only lists and quotes can contain other blocks, so a subtype always fits in
+// 16 bits here.
+struct mdview_block {
+  signed char type;       // see mdview_ctx.block_type
+  unsigned short subtype; // see mdview_ctx.block_subtype
+};
+
+// A run of input that is part of the output of mdview_feed_iov(). The input is
+// referenced instead of being copied into html_out.
+struct mdview_iov_ref {
+  size_t at;       // offset in html_out that the input goes before
+  const char *src; // the input
+  size_t len;      // length of the input
+};
+
+// A hash index of the headings in a set of documents, used to resolve and check
+// links between them (see mdview_index_add()). The whole index is kept in one
+// block of memory with the same layout as an index file, so a saved index can
+// be mapped back into memory and used without parsing it.
+struct mdview_index {
+  unsigned char *data; // the index: a header, a table of slots, and the keys
+  size_t len;          // length of data
+  size_t cap;          // allocated size of data, 0 if it is mapped from a file
+};
+
+// A heading that isn't inside of a quote or list, and the section of the
+// document that it starts. See mdview_sections_scan().
+struct mdview_section {
+  size_t start;       // offset of the heading's line in the markdown
+  size_t end;         // offset of the next section of the same or a higher
+                      // level, or the length of the markdown
+  unsigned int id;    // ID of the heading, as it is in a full render
+  unsigned int level; // level of the heading, 1-6
+};
+
+// The sections of a document, in order.
+struct mdview_sections {
+  struct mdview_section *sections;
+  size_t len;
+  size_t cap;
+};
+
+// Definitions of reference links and placeholders for the references that
+// aren't defined yet (see refs.c).
+struct mdview_refs;
+
+// Scratch space for the provisional tail, mdview_feed_iov(), and state that
+// most markdown never needs (see util.h).
+struct mdview_scratch;
+
+// The context only keeps what the caller reads or sets (the buffers, options,
+// and limits), and state that is a few bits or is checked for every character,
+// so that plain text never has to follow a pointer. The wider state of nested
+// blocks, code blocks, tables, and limits is in the scratch space instead.
 struct mdview_ctx {
   // Error message, or NULL if no error.
   const char *error_msg;
 
   // Contains finished HTML that has been generated and is about to be returned.
+  // Like every other buffer, it is only allocated once something is written to
+  // it (see mdview_release()).
   struct mdview_buf html_out;
   // A temporary buffer (used for links).
   struct mdview_buf temp_buf;
   // Pointer to the current buffer
   struct mdview_buf *curr_buf;
 
+  // Options (set these after mdview_init)
+  unsigned int provisional : 1; // 0 = off, 1 = compute a provisional tail
+                                // after each feed
+  unsigned int utf8_policy : 2; // what to do with invalid UTF-8 and control
+                                // characters: 0 = pass them through unchecked,
+                                // 1 = replace them with U+FFFD, 2 = fail with
+                                // an error
+  unsigned int highlight : 1;   // 0 = off, 1 = syntax highlight code blocks in
+                                // known languages (see highlight.h)
+  unsigned int ref_defer : 1;   // what to do with reference links that are
+                                // used before they are defined: 0 = write
+                                // them as regular text, 1 = hold back the
+                                // output until they are defined or flushed
+
+  // Limits (set these after mdview_init, 0 = no limit). They are checked after
+  // every few KB of markdown and after a flush, and if one is exceeded, then
+  // the feed or flush fails with an error and the context shouldn't be fed any
+  // more.
+  size_t max_output; // bytes of HTML generated in total
+  size_t max_temp; // bytes of markdown buffered in temp_buf, or in a possible
+                   // table's header and delimiter rows
+  unsigned int max_amplification; // bytes of HTML generated per byte of
+                                  // markdown fed, past MDVIEW_OUTPUT_SLACK
+  unsigned int time_budget_ms; // milliseconds that each feed or flush can
+                               // take
+
+  // Input validation state
+  unsigned int utf8_len : 3;  // number of bytes in utf8_buf
+  unsigned int utf8_need : 3; // length of the code point in utf8_buf
+  unsigned char utf8_buf[4];  // bytes of a code point split between feeds
+
+  // Provisional output state
+  // HTML that shows unresolved input as if the stream ended now.
+  struct mdview_buf tail_out;
+
   // Parser state
   int feeds;                // number of times mdview_feed has been called
+  int slow_path; // 1 = a table, link, image, or bare URL might be pending, or
+                 // mdview_feed_iov() is feeding. Each of them is only checked
+                 // for while this is set, so plain text stays fast.
   unsigned int special_cnt; // Count consequetive special characters (#, *, `,
                             // etc.).
   char special_type; // what type of special character is being counted. NULL is
                      // none, anything else is the character being counted.
-  int line_start;    // 0 = not beginng of line, 1 = beginning of line
-  int indent;        // number of indents at the beginning of this line
-  unsigned int id_cnt; // counter used to give unique HTML IDs to tags.
+  unsigned char line_depth; // number of open blocks (from the outermost) that
+                            // the current line continues
+  int line_start; // 0 = not beginng of line, 1 = beginning of line
+  unsigned int indent; // columns of whitespace at the beginning of this line,
+                       // counted from the last '>' marker
+  unsigned int list_num; // number of an ordered list item being counted
+  unsigned int id_cnt;   // counter used to give unique HTML IDs to tags.
 
   // Decorations/block state
-  int block_type; // -1 = none, 0 = text, 1-6 = heading, 7 = unordered list, 8 =
-                  // ordered list, 9 = code block, 10 = blockquote
+  signed int block_type : 5; // -1 = none, 0 = text, 1-6 = heading, 7 =
+                             // unordered list, 8 = ordered list, 9 = code
+                             // block, 10 = blockquote, 11 = table
+  int escaped; // 0 = no, 1 = yes
+  unsigned int text_decoration : 6; // bit field: 1 = italics, 2 = bold, 4 =
+                                    // strike, 8 = subscript, 16 = inline
+                                    // code, 32 = superscript
+  unsigned char block_depth; // number of blocks that contain the current
+                             // block, in the scratch space's block_stack
   unsigned int block_subtype; // 0 = unused. For lists, first 8 bits are the
-                              // starter used (1 = -, 2 = +, 3 = *), and next 8
-                              // bits are the number of idents. In code blocks,
-                              // this is the number of backticks used.
-  int escaped;                // 0 = no, 1 = yes
-  unsigned int text_decoration; // bit field: 1 = italics, 2 = bold, 4 = strike,
-                                // 8 = subscript, 16 = inline code,
-                                // 32 = superscript
+                              // starter used ('-', '+', '*', or for ordered
+                              // lists '.' or ')'), and next 8 bits are the
+                              // indentation of the marker. In code blocks,
+                              // this is the number of backticks used. In
+                              // tables, 1 = in the header row.
+
+  // Code block state
+  unsigned int code_info : 2; // 0 = not in an info string, 1 = before the
+                              // language, 2 = in the language, 3 = after the
+                              // language
+  unsigned int code_lang : 3; // language being highlighted, 0 = none
+  unsigned int hl_state : 4;  // type of the token the highlighter is in
+  unsigned int hl_bol : 1;    // 0 = not beginning of line, 1 = only
+                              // whitespace so far
+  unsigned int hl_word_len : 5; // length of the scratch space's hl_word
+
+  // Table state
+  unsigned int table_pending : 2; // 0 = no, 1 = reading a possible header
+                                  // row, 2 = reading a possible delimiter row
+  unsigned int table_cell : 2; // 0 = no row, 1 = after a '|' (cell not opened
+                               // yet), 2 = in a cell
 
   // Link state
-  int pending_link; // 0 = no, 1 = text part, 2 = URL part
-  int image_link;   // 0 = regular link, 1 = image link
+  unsigned int pending_link : 3; // 0 = no, 1 = text part, 2 = URL part, 3 =
+                                 // reference label part, 4 = URL of a
+                                 // reference definition, 5 = after the URL
+                                 // of a reference definition
+  unsigned int image_link : 1;   // 0 = regular link, 1 = image link
+  unsigned int link_def : 1; // 1 = the link started a line outside of any
+                             // block, so it can be a reference definition
+  unsigned int autolink : 2; // 0 = no, 1 = reading a bare URL's prefix, 2 =
+                             // reading the rest of a bare URL
+  int last_ch; // last character written as text, used to find the start of
+               // words
+  const char *in_pos; // the character being handled in the markdown that was
+                      // fed, or NULL if it isn't from there (ie: it was
+                      // buffered). mdview_feed_iov() references it instead of
+                      // copying it, and bare URLs are looked for ahead of it.
+  const char *in_end; // end of the markdown that in_pos is in
+
+  // Cross-document link state
+  const struct mdview_index *index; // documents that links to .md files are
+                                    // resolved against, or NULL to write
+                                    // links as they are
+  const char *doc_path; // path of this document, as it was added to the index
+  // Targets of links that couldn't be resolved, one per line.
+  struct mdview_buf broken_links;
+  struct mdview_index *indexing; // index that headings are added to while a
+                                 // document is indexed, or NULL
+  size_t heading_start; // offset of the current heading's text in html_out
+
+  // Reference link state, or NULL if no reference has been seen.
+  struct mdview_refs *refs;
+
+  // Zero-copy output state
+  unsigned int iov_feed : 1; // 1 = mdview_feed_iov() is feeding markdown
+
+  // Scratch space, or NULL if nothing has needed it since the context was
+  // last released.
+  struct mdview_scratch *scratch;
 };
 
 /**
@@ -66,6 +229,23 @@ __attribute__((visibility("default"))) int mdview_init(struct mdview_ctx *ctx);
 __attribute__((visibility("default"))) char *mdview_feed(struct mdview_ctx *ctx,
                                                          const char *md);
 
+/**
+ * Like mdview_feed(), but return the HTML as an array of iovecs that can be
+ * written with writev(). Plain text in the HTML points directly into md
+ * instead of being copied, and only tags and rewritten characters are
+ * generated in ctx->html_out. This means that md must not be changed or freed
+ * until the HTML has been written. Do not free the result, it is owned by the
+ * context. Note: the array may have more than IOV_MAX iovecs.
+ * @param ctx The context to update.
+ * @param md The markdown to parse as a NULL-terminated string.
+ * @param iovcnt Set to the number of iovecs in the result.
+ * @return The iovecs of the HTML that has been generated, or NULL if an error
+ *         occured (error is in ctx->error_msg; error is NULL if a
+ *         memory-related error occured).
+ */
+__attribute__((visibility("default"))) struct iovec *
+mdview_feed_iov(struct mdview_ctx *ctx, const char *md, int *iovcnt);
+
 /**
  * Return any pending HTML that has been generated but unfinished. You likely
  * want to call this function after you have fed all of your markdown to the
@@ -80,6 +260,126 @@ __attribute__((visibility("default"))) char *mdview_feed(struct mdview_ctx *ctx,
 __attribute__((visibility("default"))) char *
 mdview_flush(struct mdview_ctx *ctx);
 
+/**
+ * Return the HTML that mdview_flush() would produce if the stream ended now,
+ * without changing the state of the context. This is useful for showing text
+ * that is still pending (ie: an unfinished link or special sequence) while
+ * markdown is streamed in a few bytes at a time. The output of mdview_feed()
+ * and mdview_flush() is unaffected. If ctx->provisional is set, then this is
+ * called automatically by mdview_feed() and the result is left in
+ * ctx->tail_out.buf. Do not free the result, it is owned by the context.
+ * @param ctx The context to render the provisional tail of.
+ * @return The provisional HTML as a NULL-terminated string, or NULL if an error
+ *         occured (error is in ctx->error_msg; error is NULL if a
+ *         memory-related error occured).
+ */
+__attribute__((visibility("default"))) char *
+mdview_provisional(struct mdview_ctx *ctx);
+
+/**
+ * Initialize an empty index of documents.
+ * @param index The index to initialize.
+ * @return 0 on failure, 1 on success.
+ */
+__attribute__((visibility("default"))) int
+mdview_index_init(struct mdview_index *index);
+
+/**
+ * Add a document and the anchors of its headings to an index. Each heading can
+ * be linked to by its numeric ID or by a slug of its text (ie: "## Getting
+ * Started" is "#getting-started"). Once every document is added, set ctx->index
+ * and ctx->doc_path before feeding a document to have its links to other
+ * documents in the index rewritten and checked.
+ * @param index The index to add the document to. It must not be loaded from a
+ *              file.
+ * @param path The path of the document. Links are resolved relative to it.
+ * @param md The whole document as a NULL-terminated string.
+ * @return 0 on failure, 1 on success.
+ */
+__attribute__((visibility("default"))) int
+mdview_index_add(struct mdview_index *index, const char *path, const char *md);
+
+/**
+ * Write an index to a file so that it can be loaded with mdview_index_load().
+ * Index files are only meant to be used on the machine that wrote them.
+ * @param index The index to save.
+ * @param file The path of the file to write.
+ * @return 0 on failure, 1 on success.
+ */
+__attribute__((visibility("default"))) int
+mdview_index_save(const struct mdview_index *index, const char *file);
+
+/**
+ * Map an index file written by mdview_index_save() into memory. The loaded
+ * index is read-only, so no documents can be added to it.
+ * @param index The index to load into. It must not be initialized.
+ * @param file The path of the file to load.
+ * @return 0 on failure (including if the file isn't a valid index), 1 on
+ *         success.
+ */
+__attribute__((visibility("default"))) int
+mdview_index_load(struct mdview_index *index, const char *file);
+
+/**
+ * Free or unmap an index.
+ * @param index The index to free.
+ */
+__attribute__((visibility("default"))) void
+mdview_index_free(struct mdview_index *index);
+
+/**
+ * Find the sections of a document without parsing it. Only the beginning of
+ * each line, fences, inline code, and escapes are looked at, so this is much
+ * faster than rendering the document. A section starts with a heading at the
+ * very beginning of a line, and it includes the sections of lower-level
+ * headings after it.
+ * @param sections The sections to fill in. It must not be initialized.
+ * @param md The whole document.
+ * @param len The length of the document.
+ * @return 0 on failure, 1 on success.
+ */
+__attribute__((visibility("default"))) int
+mdview_sections_scan(struct mdview_sections *sections, const char *md,
+                     size_t len);
+
+/**
+ * Free the sections found by mdview_sections_scan().
+ * @param sections The sections to free.
+ */
+__attribute__((visibility("default"))) void
+mdview_sections_free(struct mdview_sections *sections);
+
+/**
+ * Render one section of a document, with the same heading IDs that it has
+ * when the whole document is rendered. This feeds and flushes the section, so
+ * the context must be newly initialized (options can be set), and it can't be
+ * fed any more afterwards. Do not free the result, it is owned by the
+ * context.
+ * @param ctx The context to render the section with.
+ * @param md The whole document, as it was given to mdview_sections_scan().
+ * @param sections The sections of the document.
+ * @param section The index of the section to render in sections.
+ * @return The HTML of the section as a NULL-terminated string, or NULL if an
+ *         error occured (error is in ctx->error_msg; error is NULL if a
+ *         memory-related error occured).
+ */
+__attribute__((visibility("default"))) char *
+mdview_render_range(struct mdview_ctx *ctx, const char *md,
+                    const struct mdview_sections *sections, size_t section);
+
+/**
+ * Free the memory of every buffer that the context isn't using right now, so
+ * that an idle context (ie: a stream that is waiting for more markdown) only
+ * costs the size of the context itself. The scratch space is kept while it
+ * holds state, ie: inside of a nested block, a code block or a table, or while
+ * output limits are set. Buffers are allocated again when they are needed.
+ * Note: any HTML or iovecs returned by the context before this is called can't
+ * be used afterwards.
+ * @param ctx The context to release the buffers of.
+ */
+__attribute__((visibility("default"))) void
+mdview_release(struct mdview_ctx *ctx);
+
 /**
  * Free any resources associated with the context. Note: this does not free the
  * context itself, you must do that yourself.
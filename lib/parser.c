@@ -1,21 +1,56 @@
 #include "parser.h"
+#include "highlight.h"
+#include "iov.h"
 #include "links.h"
 #include "mdview.h"
+#include "tables.h"
 #include "tags.h"
 #include "util.h"
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 
+// Write whitespace at the beginning of a line of code.
+static int code_space(struct mdview_ctx *ctx, char ch) {
+  return ctx->code_lang ? highlight_char(ctx, ch) : bufadd(ctx->curr_buf, ch);
+}
+
+// Write the indentation of a line of code past the opening fence's as spaces.
+static int write_code_indent(struct mdview_ctx *ctx) {
+  for (; ctx->indent > ctx->scratch->code_indent; ctx->indent--) {
+    if (!code_space(ctx, ' '))
+      return 0;
+  }
+  return 1;
+}
+
 // Handle a newline character and update figure out which block elements need
 // to be created/closed.
 static int handle_newline(struct mdview_ctx *ctx) {
-  if (ctx->line_start && ctx->block_type != -1 && ctx->block_type != 9) {
-    // if there has been two consequetive newlines, then close the current
-    // block.
-    close_block(ctx);
+  // a link that could have been a reference definition doesn't end on this
+  // line, so its paragraph is opened like it is for any other text
+  if (ctx->link_def) {
+    ctx->link_def = 0;
+    if (ctx->temp_buf.len > 0 && !open_text(ctx))
+      return 0;
+  }
+
+  // a line of code with only whitespace keeps it
+  if (ctx->line_start && ctx->block_type == 9 && !write_code_indent(ctx))
+    return 0;
+
+  // the next line starts a word
+  ctx->last_ch = '\n';
+
+  if (ctx->line_start && ctx->line_depth == 0 && ctx->block_type != -1 &&
+      ctx->block_type != 9) {
+    // if there has been two consequetive newlines, then close all blocks.
+    if (!close_all_blocks(ctx))
+      return 0;
   } else {
     ctx->line_start = 1;
     ctx->indent = 0;
+    ctx->line_depth = 0;
   }
 
   // different newline behavior depending on block
@@ -33,8 +68,15 @@ static int handle_newline(struct mdview_ctx *ctx) {
   case 4:
   case 5:
   case 6:
-    return close_block(ctx);
+    // a header is one line, so a link in it can't go on to the next one
+    return end_link(ctx) && close_block(ctx);
+  case 11:
+    return table_end_row(ctx);
   case 9:
+    if (ctx->code_info)
+      return handle_code_info(ctx, '\n');
+    if (ctx->code_lang)
+      return highlight_char(ctx, '\n');
     return bufadd(ctx->curr_buf, '\n');
   default:
     fprintf(stderr, "Undefined newline behavior for block type %d\n",
@@ -48,6 +90,19 @@ static int handle_newline(struct mdview_ctx *ctx) {
 // Count a special character and update the context. Returns 0 on error, 1 on
 // success, and 2 on success and a valid special sequence has ended.
 static int count_special_char(struct mdview_ctx *ctx, char ch) {
+  // The number of an ordered list item is counted as a sequence of '1's, and
+  // the '.' or ')' after it replaces the type of the sequence.
+  if (ctx->special_type == '1') {
+    if (isdigit((unsigned char)ch)) {
+      ctx->special_cnt++;
+      ctx->list_num = ctx->list_num * 10 + (ch - '0');
+      return 1;
+    } else if (ch == '.' || ch == ')') {
+      ctx->special_type = ch;
+      return 1;
+    }
+  }
+
   // If the character is the same as the previous, then keep counting.
   // Otherwise, end the previous special sequence and start a new one.
   if (ctx->special_type == ch) {
@@ -59,17 +114,81 @@ static int count_special_char(struct mdview_ctx *ctx, char ch) {
       return 0;
     ctx->special_cnt = 1;
     ctx->special_type = ch;
+    if (isdigit((unsigned char)ch)) {
+      ctx->special_type = '1';
+      ctx->list_num = ch - '0';
+    }
     return valid_seq;
   }
 }
 
+// Returns 1 if the character might be part of an ordered list item's number:
+// up to 9 digits at the beginning of a line, followed by a '.' or ')'.
+static inline int is_list_number_char(struct mdview_ctx *ctx, char ch) {
+  if (ctx->special_type == '1')
+    return (isdigit((unsigned char)ch) && ctx->special_cnt < 9) || ch == '.' ||
+           ch == ')';
+  return ctx->line_start && isdigit((unsigned char)ch);
+}
+
+// Write the number of an ordered list item that turned out not to be one as
+// regular characters.
+static int write_list_number(struct mdview_ctx *ctx) {
+  char digits[16];
+  snprintf(digits, sizeof(digits), "%0*u", (int)ctx->special_cnt,
+           ctx->list_num);
+  for (char *digit = digits; *digit; digit++) {
+    if (!handle_regular_char(ctx, *digit))
+      return 0;
+  }
+  if (ctx->special_type != '1')
+    return handle_regular_char(ctx, ctx->special_type);
+  return 1;
+}
+
 int handle_regular_char(struct mdview_ctx *ctx, char ch) {
+  // whitespace at the beginning of a line is counted as indentation, and
+  // whitespace around table cells is trimmed. code only loses the opening
+  // fence's indentation, and up to 3 spaces past it are held back because
+  // they might indent the closing fence.
+  if (ch == ' ' || ch == '\t') {
+    ctx->last_ch = ch;
+    if (ctx->line_start &&
+        (ctx->block_type != 9 || ctx->indent < ctx->scratch->code_indent ||
+         (ch == ' ' && ctx->indent < ctx->scratch->code_indent + 3))) {
+      ctx->indent += ch == '\t' ? 4 : 1;
+      return 1;
+    }
+    if (ctx->line_start) {
+      // the rest of the whitespace is kept as it is. the line hasn't started
+      // yet, so the closing fence can still be indented.
+      return write_code_indent(ctx) && code_space(ctx, ch);
+    }
+    if (ctx->block_type == 11 && ctx->curr_buf == &ctx->html_out) {
+      if (ctx->table_cell == 2)
+        ctx->scratch->table_space++;
+      return 1;
+    }
+  }
+
   // this is a regular char, so the escape should expire after this char.
   ctx->escaped = 0;
+
+  // code keeps its indentation past the opening fence's
+  if (ctx->line_start && ctx->block_type == 9 && !write_code_indent(ctx))
+    return 0;
   ctx->line_start = 0;
 
+  // the info string and highlighted code handle their own characters
+  if (ctx->block_type == 9) {
+    if (ctx->code_info)
+      return handle_code_info(ctx, ch);
+    if (ctx->code_lang)
+      return highlight_char(ctx, ch);
+  }
+
   // end the current link if we're in one and the link is invalid
-  if (ctx->pending_link && ctx->temp_buf.len > 0) {
+  if (ctx->slow_path && ctx->pending_link && ctx->temp_buf.len > 0) {
     char last_link_char = ctx->temp_buf.buf[ctx->temp_buf.len - 1];
     // invalidate this link if we're between the text and the URL, or if there
     // is a space in the URL.
@@ -80,10 +199,24 @@ int handle_regular_char(struct mdview_ctx *ctx, char ch) {
     }
   }
 
-  // if we have nowhere to write to, then start a paragraph
-  if (ctx->block_type == -1)
-    block_paragraph(ctx);
+  // if we have nowhere to write to, then start a paragraph or table cell. a
+  // link that might be a reference definition doesn't start one yet.
+  if ((ctx->block_type == -1 || ctx->block_type == 11) &&
+      !(ctx->pending_link && ctx->link_def) && !open_text(ctx))
+    return 0;
 
+  // a word starting with 'h' or 'w' might be a bare URL. code and link text
+  // are never linked.
+  if ((ch == 'h' || ch == 'w') && !isalnum((unsigned char)ctx->last_ch) &&
+      ctx->curr_buf == &ctx->html_out && ctx->block_type != 9 &&
+      !(ctx->text_decoration & 16) && autolink_candidate(ctx, ch))
+    return start_autolink(ctx, ch);
+
+  ctx->last_ch = ch;
+  // plain text is referenced instead of copied by mdview_feed_iov()
+  if (ctx->slow_path && ctx->iov_feed && ctx->in_pos && *ctx->in_pos == ch &&
+      ctx->curr_buf == &ctx->html_out)
+    return iov_ref_input(ctx);
   if (!bufadd(ctx->curr_buf, ch))
     return 0;
   return 1;
@@ -99,7 +232,7 @@ int end_special_sequence(struct mdview_ctx *ctx, char curr_ch) {
   switch (ctx->special_type) {
   case '*':
     if (ctx->special_cnt == 1 && ctx->line_start && curr_ch == ' ') {
-      if (!unordered_list_item(ctx, ctx->special_type))
+      if (!list_item(ctx, 7, ctx->special_type, 0))
         return 0;
       goto end;
     } else if (ctx->special_cnt == 1) {
@@ -122,8 +255,8 @@ int end_special_sequence(struct mdview_ctx *ctx, char curr_ch) {
     break;
   case '-':
     if (ctx->special_cnt == 1 && ctx->line_start && curr_ch == ' ') {
-      if (!unordered_list_item(ctx, ctx->special_type))
-        return 1;
+      if (!list_item(ctx, 7, ctx->special_type, 0))
+        return 0;
       goto end;
     } else if (ctx->special_cnt == 3 && ctx->line_start && curr_ch == '\n') {
       if (!bufcat(ctx->curr_buf, "<hr>", 4))
@@ -142,15 +275,21 @@ int end_special_sequence(struct mdview_ctx *ctx, char curr_ch) {
   case '`':
     // we need to be careful here, this can be called from inside a code block!
     if (ctx->special_cnt == 1 && ctx->block_type != 9) {
-      // don't do this if we're in a code block
+      // don't do this if we're in a code block. inline code is text, so blocks
+      // can't start after it opens.
+      if (!(ctx->text_decoration & 16))
+        ctx->line_start = 0;
       if (!toggle_inline_code(ctx))
         return 0;
       goto end;
     } else if (ctx->special_cnt >= 3 && ctx->line_start) {
       if (ctx->block_type == 9 && ctx->special_cnt == ctx->block_subtype) {
         // end block code if we're in a code block and the number of backticks
-        // matches the number of backticks that started the block
-        close_block(ctx);
+        // matches the number of backticks that started the block. the rest
+        // of the line doesn't make it a blank line.
+        if (!close_block(ctx))
+          return 0;
+        ctx->line_start = 0;
       } else {
         if (!block_code(ctx, ctx->special_cnt))
           return 0;
@@ -177,7 +316,8 @@ int end_special_sequence(struct mdview_ctx *ctx, char curr_ch) {
     }
     break;
   case '>':
-    if (ctx->special_cnt == 1 && ctx->line_start && curr_ch == ' ') {
+    if (ctx->special_cnt == 1 && ctx->line_start &&
+        (curr_ch == ' ' || curr_ch == '\n')) {
       if (!block_quote(ctx))
         return 0;
       goto end;
@@ -185,11 +325,25 @@ int end_special_sequence(struct mdview_ctx *ctx, char curr_ch) {
     break;
   case '+':
     if (ctx->special_cnt == 1 && ctx->line_start && curr_ch == ' ') {
-      if (!unordered_list_item(ctx, ctx->special_type))
+      if (!list_item(ctx, 7, ctx->special_type, 0))
         return 0;
       goto end;
     }
     break;
+  case '.':
+  case ')':
+    if (ctx->line_start && curr_ch == ' ') {
+      if (!list_item(ctx, 8, ctx->special_type, ctx->list_num))
+        return 0;
+      goto end;
+    }
+    // fallthrough
+  case '1':
+    if (!write_list_number(ctx))
+      return 0;
+    ctx->special_cnt = 0;
+    ctx->special_type = 0;
+    return 1;
   }
 
   // if not matched, then write the special characters as regular characters
@@ -206,14 +360,76 @@ end:
   return 2;
 }
 
+// Characters that are always plain text when they aren't at the beginning of a
+// line: everything but special characters, link characters, escapes, table
+// pipes, control characters (except tabs), and the letters that bare URLs start
+// with.
+static const unsigned char plain_chars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+    1, 0, 1, 0, 1, 1, 1, 1, 0, 0, 0, 0, 1, 0, 1, 1, // 0x20
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 0, 1, // 0x30
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, // 0x50
+    0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 0, 1, 0, 0, // 0x70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xC0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xD0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xE0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xF0
+};
+
+// Handle the states that ctx->slow_path stands for. Returns -1 if the
+// character still has to be handled regularly.
+static int handle_slow_char(struct mdview_ctx *ctx, char ch) {
+  // a possible table is buffered until its delimiter row is done, and a
+  // possible URL until it ends. the rest of a reference definition's line is
+  // read raw.
+  if (ctx->table_pending)
+    return table_pending_char(ctx, ch);
+  if (ctx->autolink)
+    return autolink_char(ctx, ch);
+  if (ctx->pending_link >= 4)
+    return ref_def_char(ctx, ch);
+  // only a '[' makes a '!' the start of an image. anything else, even a special
+  // character, is written after it.
+  if (ctx->image_link && ch != '[' && !end_image_link(ctx))
+    return 0;
+
+  // the flag is set whenever one of these starts, and cleared here once none
+  // of them are left
+  if (!ctx->pending_link && !ctx->image_link && !ctx->iov_feed)
+    ctx->slow_path = 0;
+  return -1;
+}
+
 int handle_char(struct mdview_ctx *ctx, char ch) {
   // If this is code, then only handle handle backtick as special characters.
   // Otherwise, handle all unescaped special characters.
   int is_code;
+
+  if (ctx->slow_path) {
+    int handled = handle_slow_char(ctx, ch);
+    if (handled != -1)
+      return handled;
+  } else if (plain_chars[(unsigned char)ch] && !ctx->line_start &&
+             !ctx->escaped && ctx->special_cnt == 0 && ctx->block_type >= 0 &&
+             ctx->block_type != 9 && ctx->block_type != 11 &&
+             !(ctx->text_decoration & 16)) {
+    // plain text in a block that is already open is by far the most common
+    // case, so it is written right away
+    ctx->last_ch = ch;
+    return bufadd(&ctx->html_out, ch);
+  }
 start:
   is_code = ctx->block_type == 9 || ctx->text_decoration & 16;
   if ((is_code && ch == '`') ||
-      (!is_code && !ctx->escaped && strchr("*-#`^~>+", ch))) {
+      (!is_code && !ctx->escaped &&
+       (strchr("*-#`^~>+", ch) || is_list_number_char(ctx, ch)))) {
     int success = count_special_char(ctx, ch);
     if (!success) {
       return 0;
@@ -238,15 +454,34 @@ start:
   // re-check if we're in a code block; we might have just entered one.
   is_code = ctx->block_type == 9 || ctx->text_decoration & 16;
 
+  // info strings and highlighted code are written raw, without any rewrites
+  if (ctx->block_type == 9 && (ctx->code_info || ctx->code_lang) && ch != '\n')
+    return handle_regular_char(ctx, ch);
+
   // handle link special characters, if any. return if one was handled.
   if (!is_code && !ctx->escaped) {
     int link_handled = handle_link_special_char(ctx, ch);
+    // a link is text, so blocks can't start after it on the same line
+    if (link_handled == 1)
+      ctx->line_start = 0;
     if (link_handled == 0 || link_handled == 1)
       return link_handled;
   }
 
   // handle escaped characters that must be rewritten
   if (ctx->escaped || is_code) {
+    // these are written directly, so open the table cell first, or write the
+    // indentation of the line of code that was held back
+    if ((ch == '<' || ch == '>' || ch == '\\') && ctx->block_type == 11 &&
+        !open_text(ctx))
+      return 0;
+    if ((ch == '<' || ch == '>' || ch == '\\') && ctx->line_start &&
+        ctx->block_type == 9 && !write_code_indent(ctx))
+      return 0;
+    // in code, they are text, so blocks can't start after them. an escape goes
+    // on past them, and whatever it ends with can't start a block either.
+    if (is_code && (ch == '<' || ch == '>' || ch == '\\'))
+      ctx->line_start = 0;
     // handle escaped character that require rewrites
     if (ch == '<') {
       return bufcat(ctx->curr_buf, "&lt;", 4);
@@ -265,6 +500,14 @@ start:
     return 1;
   case '\n':
     return handle_newline(ctx);
+  case '|':
+    if (!ctx->escaped && !is_code) {
+      if (ctx->block_type == 11)
+        return table_pipe(ctx);
+      if (ctx->line_start && ctx->curr_buf == &ctx->html_out)
+        return table_start(ctx);
+    }
+    return handle_regular_char(ctx, ch);
   default:
     return handle_regular_char(ctx, ch);
   }
@@ -0,0 +1,380 @@
+#include "refs.h"
+#include "anchors.h"
+#include "mdview.h"
+#include "tags.h"
+#include "util.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Reference state
+ *
+ * Definitions are kept in an open-addressing hash table, keyed by their
+ * normalized label. Reference links that are written before their label is
+ * defined become placeholders: only their text is written to the output, and
+ * the output from the first placeholder on is held back until they can be
+ * patched. Labels and URLs are kept in one buffer of strings, so memory grows
+ * with the number of definitions and references rather than the document.
+ */
+
+#define REFS_MIN_SLOTS 16
+
+struct ref_def {
+  uint32_t hash;
+  size_t key;     // offset of the normalized label in strings
+  size_t key_len; // 0 = empty slot
+  size_t url;     // offset of the URL in strings
+};
+
+struct ref_use {
+  size_t start;   // offset of the text in html_out, or in held once it is
+                  // held back
+  size_t end;     // offset of the end of the text
+  uint32_t hash;  // hash of the normalized label
+  size_t key;     // offset of the normalized label in strings
+  size_t key_len; // length of the normalized label
+  size_t label;   // offset of the label as it was written in strings
+  int image;      // 0 = regular link, 1 = image link
+};
+
+struct mdview_refs {
+  // Normalized labels, URLs, and labels of placeholders. URLs and labels of
+  // placeholders are NUL-terminated.
+  struct mdview_buf strings;
+  // Definitions
+  struct ref_def *defs;
+  size_t defs_cap; // number of slots, always a power of 2
+  size_t defs_used;
+  // Placeholders, in the order they were written.
+  struct ref_use *uses;
+  size_t uses_len;
+  size_t uses_cap;
+  size_t uses_held; // number of placeholders that are in held
+  // Output that is held back, starting at the first placeholder.
+  struct mdview_buf held;
+  int new_defs; // 1 = something was defined since the output was held back
+};
+
+// Returns the reference state of a context, which is allocated when it is
+// first needed.
+static struct mdview_refs *get_refs(struct mdview_ctx *ctx) {
+  if (!ctx->refs) {
+    ctx->refs = calloc(1, sizeof(struct mdview_refs));
+    if (!ctx->refs)
+      perror("calloc");
+  }
+  return ctx->refs;
+}
+
+// FNV-1a
+static uint32_t hash_label(const char *key, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Add the normalized version of a label to the strings: letters are lowercase,
+// and whitespace is collapsed into single spaces and trimmed. Returns 0 on
+// error, 1 on success.
+static int add_key(struct mdview_refs *refs, const char *label, size_t *key,
+                   size_t *key_len) {
+  *key = refs->strings.len;
+  int space = 0;
+  for (const char *ch = label; *ch; ch++) {
+    if (isspace((unsigned char)*ch)) {
+      space = refs->strings.len > *key;
+      continue;
+    }
+    if (space && !bufadd(&refs->strings, ' '))
+      return 0;
+    space = 0;
+    if (!bufadd(&refs->strings, (char)tolower((unsigned char)*ch)))
+      return 0;
+  }
+  *key_len = refs->strings.len - *key;
+  return 1;
+}
+
+// Find the slot of a label, or the empty slot it would go in.
+static struct ref_def *find_slot(struct mdview_refs *refs, const char *key,
+                                 size_t len, uint32_t hash) {
+  size_t mask = refs->defs_cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    struct ref_def *def = &refs->defs[i];
+    if (def->key_len == 0)
+      return def;
+    if (def->hash == hash && def->key_len == len &&
+        memcmp(refs->strings.buf + def->key, key, len) == 0)
+      return def;
+  }
+}
+
+// Returns the definition of a normalized label, or NULL if it isn't defined.
+static struct ref_def *find_def(struct mdview_refs *refs, size_t key,
+                                size_t len, uint32_t hash) {
+  if (refs->defs_cap == 0)
+    return NULL;
+  struct ref_def *def = find_slot(refs, refs->strings.buf + key, len, hash);
+  return def->key_len ? def : NULL;
+}
+
+// Make room for one more definition. Every definition is rehashed if the table
+// has to grow.
+static int defs_reserve(struct mdview_refs *refs) {
+  if ((refs->defs_used + 1) * 2 <= refs->defs_cap)
+    return 1;
+
+  size_t old_cap = refs->defs_cap;
+  struct ref_def *old = refs->defs;
+  size_t cap = old_cap ? old_cap * 2 : REFS_MIN_SLOTS;
+  refs->defs = calloc(cap, sizeof(struct ref_def));
+  if (!refs->defs) {
+    perror("calloc");
+    refs->defs = old;
+    return 0;
+  }
+  refs->defs_cap = cap;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].key_len)
+      *find_slot(refs, refs->strings.buf + old[i].key, old[i].key_len,
+                 old[i].hash) = old[i];
+  }
+  free(old);
+  return 1;
+}
+
+int add_ref_def(struct mdview_ctx *ctx, char *label, char *url) {
+  struct mdview_refs *refs = get_refs(ctx);
+  size_t key, key_len;
+  if (!refs || !add_key(refs, label, &key, &key_len))
+    return 0;
+  if (key_len == 0)
+    return 1;
+
+  // the first definition of a label is the one that is used
+  uint32_t hash = hash_label(refs->strings.buf + key, key_len);
+  if (find_def(refs, key, key_len, hash)) {
+    refs->strings.len = key;
+    return 1;
+  }
+
+  size_t url_at = refs->strings.len;
+  if (!bufcat(&refs->strings, url, strlen(url)) ||
+      !bufadd(&refs->strings, '\0') || !defs_reserve(refs))
+    return 0;
+  struct ref_def *def =
+      find_slot(refs, refs->strings.buf + key, key_len, hash);
+  def->hash = hash;
+  def->key = key;
+  def->key_len = key_len;
+  def->url = url_at;
+  refs->defs_used++;
+
+  if (refs->uses_len > 0)
+    refs->new_defs = 1;
+  return 1;
+}
+
+// Write a reference link that can't be resolved as regular text.
+static int write_ref_text(struct mdview_buf *buf, int image, char *text,
+                          size_t text_len, char *label) {
+  return (!image || bufadd(buf, '!')) && bufadd(buf, '[') &&
+         bufcat(buf, text, text_len) && bufcat(buf, "][", 2) &&
+         bufcat(buf, label, strlen(label)) && bufadd(buf, ']');
+}
+
+int write_ref_link(struct mdview_ctx *ctx, char *text, char *label) {
+  struct mdview_refs *refs = get_refs(ctx);
+  size_t key, key_len;
+  // "[text][]" uses the text as the label
+  if (!refs || !add_key(refs, *label ? label : text, &key, &key_len))
+    return 0;
+  uint32_t hash = hash_label(refs->strings.buf + key, key_len);
+  struct ref_def *def = key_len ? find_def(refs, key, key_len, hash) : NULL;
+
+  if (def || !ctx->ref_defer || key_len == 0) {
+    // the label is only kept for placeholders
+    refs->strings.len = key;
+    if (def)
+      return write_link(ctx, refs->strings.buf + def->url, text);
+    return write_ref_text(&ctx->html_out, ctx->image_link, text, strlen(text),
+                          label);
+  }
+
+  // write the text as a placeholder
+  if (refs->uses_len == refs->uses_cap) {
+    size_t cap = refs->uses_cap ? refs->uses_cap * 2 : 16;
+    struct ref_use *tmp = realloc(refs->uses, cap * sizeof(struct ref_use));
+    if (!tmp) {
+      perror("realloc");
+      return 0;
+    }
+    refs->uses = tmp;
+    refs->uses_cap = cap;
+  }
+  // the output from here on is held back and copied, so mdview_feed_iov()
+  // can't reference input in it
+  ctx->iov_feed = 0;
+  struct ref_use *use = &refs->uses[refs->uses_len];
+  use->hash = hash;
+  use->key = key;
+  use->key_len = key_len;
+  use->label = refs->strings.len;
+  use->image = ctx->image_link;
+  if (!bufcat(&refs->strings, label, strlen(label)) ||
+      !bufadd(&refs->strings, '\0'))
+    return 0;
+  use->start = ctx->html_out.len;
+  if (!bufcat(&ctx->html_out, text, strlen(text)))
+    return 0;
+  use->end = ctx->html_out.len;
+  refs->uses_len++;
+  return 1;
+}
+
+// Move the output from the first placeholder on (or all of it, if output was
+// already held back) from html_out to the held output.
+static int hold_output(struct mdview_ctx *ctx) {
+  struct mdview_refs *refs = ctx->refs;
+  size_t at = refs->uses_held ? 0 : refs->uses[0].start;
+  for (size_t i = refs->uses_held; i < refs->uses_len; i++) {
+    refs->uses[i].start = refs->uses[i].start - at + refs->held.len;
+    refs->uses[i].end = refs->uses[i].end - at + refs->held.len;
+  }
+  refs->uses_held = refs->uses_len;
+
+  if (ctx->html_out.len > at) {
+    if (!bufcat(&refs->held, ctx->html_out.buf + at, ctx->html_out.len - at))
+      return 0;
+    ctx->html_out.len = at;
+    ctx->html_out.buf[at] = '\0';
+  }
+  return 1;
+}
+
+// Write the held output to html_out up to the placeholder n, patching every
+// placeholder before it. Placeholders that can't be resolved are written as
+// regular text.
+static int patch_output(struct mdview_ctx *ctx, size_t n) {
+  struct mdview_refs *refs = ctx->refs;
+  struct mdview_buf *out = &ctx->html_out;
+  char *held = refs->held.buf ? refs->held.buf : "";
+
+  // links are written to html_out like they are by write_link()
+  struct mdview_buf *curr_buf = ctx->curr_buf;
+  unsigned int image_link = ctx->image_link;
+  ctx->curr_buf = out;
+  ctx->image_link = 0;
+
+  int success = 1;
+  size_t at = 0;
+  for (size_t i = 0; success && i < n; i++) {
+    struct ref_use *use = &refs->uses[i];
+    char *text = held + use->start;
+    size_t text_len = use->end - use->start;
+    struct ref_def *def = find_def(refs, use->key, use->key_len, use->hash);
+    char *url = def ? refs->strings.buf + def->url : NULL;
+    success = bufcat(out, held + at, use->start - at);
+    if (success && !def) {
+      success = write_ref_text(out, use->image, text, text_len,
+                               refs->strings.buf + use->label);
+    } else if (success && use->image) {
+      success = bufcat(out, "<img src=\"", 10) &&
+                bufcat(out, url, strlen(url)) &&
+                bufcat(out, "\" alt=\"", 7) && bufcat(out, text, text_len) &&
+                bufcat(out, "\" />", 4);
+    } else if (success) {
+      success = bufcat(out, "<a href=\"", 9) && write_link_url(ctx, url) &&
+                bufcat(out, "\">", 2) && bufcat(out, text, text_len) &&
+                bufcat(out, "</a>", 4);
+    }
+    at = use->end;
+  }
+  size_t end = n < refs->uses_len ? refs->uses[n].start : refs->held.len;
+  success = success && bufcat(out, held + at, end - at);
+  ctx->curr_buf = curr_buf;
+  ctx->image_link = image_link;
+  if (!success)
+    return 0;
+
+  // the rest stays held back
+  if (refs->held.buf) {
+    memmove(held, held + end, refs->held.len - end);
+    refs->held.len -= end;
+    held[refs->held.len] = '\0';
+  }
+  refs->uses_len -= n;
+  memmove(refs->uses, refs->uses + n, refs->uses_len * sizeof(struct ref_use));
+  for (size_t i = 0; i < refs->uses_len; i++) {
+    refs->uses[i].start -= end;
+    refs->uses[i].end -= end;
+  }
+  refs->uses_held = refs->uses_len;
+  return 1;
+}
+
+int ref_pending(const struct mdview_ctx *ctx) {
+  return ctx->refs && ctx->refs->uses_len > 0;
+}
+
+size_t ref_held_len(const struct mdview_ctx *ctx) {
+  return ctx->refs ? ctx->refs->held.len : 0;
+}
+
+int ref_feed_end(struct mdview_ctx *ctx) {
+  struct mdview_refs *refs = ctx->refs;
+  if (!refs || refs->uses_len == 0)
+    return 1;
+  if (!hold_output(ctx))
+    return 0;
+  if (!refs->new_defs)
+    return 1;
+  refs->new_defs = 0;
+
+  // release the output up to the first placeholder that still can't be
+  // resolved
+  size_t n = 0;
+  while (n < refs->uses_len &&
+         find_def(refs, refs->uses[n].key, refs->uses[n].key_len,
+                  refs->uses[n].hash))
+    n++;
+  return n == 0 || patch_output(ctx, n);
+}
+
+int ref_flush(struct mdview_ctx *ctx) {
+  struct mdview_refs *refs = ctx->refs;
+  if (!refs || refs->uses_len == 0)
+    return 1;
+  return hold_output(ctx) && patch_output(ctx, refs->uses_len);
+}
+
+void ref_release(struct mdview_ctx *ctx) {
+  struct mdview_refs *refs = ctx->refs;
+  if (!refs || refs->uses_len > 0)
+    return;
+  free(refs->uses);
+  refs->uses = NULL;
+  refs->uses_cap = 0;
+  free(refs->held.buf);
+  refs->held.buf = NULL;
+  refs->held.len = 0;
+  refs->held.cap = 0;
+}
+
+void ref_free(struct mdview_ctx *ctx) {
+  struct mdview_refs *refs = ctx->refs;
+  if (!refs)
+    return;
+  free(refs->strings.buf);
+  free(refs->defs);
+  free(refs->uses);
+  free(refs->held.buf);
+  free(refs);
+  ctx->refs = NULL;
+}
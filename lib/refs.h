@@ -0,0 +1,35 @@
+#pragma once
+
+#include "mdview.h"
+
+// Store the definition of a reference ("[label]: url"). If the label is
+// already defined, then the first definition is kept.
+int add_ref_def(struct mdview_ctx *ctx, char *label, char *url);
+
+// Write a reference link ("[text][label]"). If the label is already defined,
+// then the link is written right away. Otherwise, it is written as regular
+// text, or if ctx->ref_defer is set, the text is written as a placeholder that
+// is patched once the label is defined.
+int write_ref_link(struct mdview_ctx *ctx, char *text, char *label);
+
+// Returns 1 if there are placeholders that haven't been patched yet.
+int ref_pending(const struct mdview_ctx *ctx);
+
+// Returns the number of bytes of output that are held back.
+size_t ref_held_len(const struct mdview_ctx *ctx);
+
+// Hold back the output from the first placeholder on, and patch the
+// placeholders if every one of them can be resolved now. This is called at the
+// end of every feed.
+int ref_feed_end(struct mdview_ctx *ctx);
+
+// Patch every placeholder that is left and write out everything that was held
+// back. References that were never defined are written as regular text. This
+// is called by mdview_flush().
+int ref_flush(struct mdview_ctx *ctx);
+
+// Free the memory used for placeholders if there aren't any.
+void ref_release(struct mdview_ctx *ctx);
+
+// Free the definitions and placeholders.
+void ref_free(struct mdview_ctx *ctx);
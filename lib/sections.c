@@ -0,0 +1,266 @@
+#include "mdview.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Section index
+ *
+ * The pre-scan only looks at what decides where headings are and what their
+ * IDs are: the beginning of each line, fences, inline code, and escapes. Text
+ * in between is skipped over a word at a time.
+ */
+
+// Returns the offset of the first newline, backtick, or backslash at or after
+// offset i, or len if there are none.
+static size_t next_special(const unsigned char *str, size_t i, size_t len) {
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i tick = _mm_set1_epi8('`');
+  const __m128i slash = _mm_set1_epi8('\\');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+    __m128i hit = _mm_or_si128(
+        _mm_cmpeq_epi8(v, nl),
+        _mm_or_si128(_mm_cmpeq_epi8(v, tick), _mm_cmpeq_epi8(v, slash)));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+#else
+  // check 8 bytes at a time. a word with a zero byte after being XORed with
+  // one of the characters contains that character.
+  const uint64_t ones = 0x0101010101010101ull;
+  const uint64_t highs = 0x8080808080808080ull;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, str + i, 8);
+    uint64_t a = w ^ (ones * '\n'), b = w ^ (ones * '`'), c = w ^ (ones * '\\');
+    if ((((a - ones) & ~a) | ((b - ones) & ~b) | ((c - ones) & ~c)) & highs)
+      break;
+  }
+#endif
+
+  while (i < len && str[i] != '\n' && str[i] != '`' && str[i] != '\\')
+    i++;
+  return i;
+}
+
+// Returns the length of the run of a character at offset i.
+static size_t run_len(const unsigned char *str, size_t i, size_t len,
+                      unsigned char ch) {
+  size_t start = i;
+  while (i < len && str[i] == ch)
+    i++;
+  return i - start;
+}
+
+// Returns the offset of the character that an escape at offset i ends with.
+// An escaped backslash or angle bracket is written without ending the escape,
+// so the character after it is escaped too.
+static size_t escape_end(const unsigned char *str, size_t i, size_t len) {
+  while (i < len && (str[i] == '\\' || str[i] == '<' || str[i] == '>'))
+    i++;
+  return i;
+}
+
+// Returns the length of a quote or list marker (and the space after it) at
+// offset i, or 0 if there isn't one.
+static size_t marker_len(const unsigned char *str, size_t i, size_t len) {
+  if (i + 1 >= len)
+    return 0;
+  if (str[i] == '>' && (str[i + 1] == ' ' || str[i + 1] == '\n'))
+    return 1;
+  if ((str[i] == '-' || str[i] == '+' || str[i] == '*') && str[i + 1] == ' ')
+    return 2;
+
+  // up to 9 digits, followed by a '.' or ')'
+  size_t digits = 0;
+  while (i + digits < len && digits < 9 && isdigit(str[i + digits]))
+    digits++;
+  if (digits && i + digits + 1 < len &&
+      (str[i + digits] == '.' || str[i + digits] == ')') &&
+      str[i + digits + 1] == ' ')
+    return digits + 2;
+  return 0;
+}
+
+// Returns the length of the emphasis, subscript, strikethrough, and
+// superscript markers at offset i, or 0 if there aren't any. Quotes, lists,
+// headings, and fences can still start right after them.
+static size_t decoration_len(const unsigned char *str, size_t i, size_t len) {
+  size_t start = i;
+  while (i < len) {
+    size_t run;
+    if (str[i] == '*' && (run = run_len(str, i, len, '*')) <= 3)
+      i += run;
+    else if (str[i] == '~' && (run = run_len(str, i, len, '~')) <= 2)
+      i += run;
+    else if (str[i] == '^' && (run = run_len(str, i, len, '^')) == 1)
+      i += run;
+    else
+      break;
+  }
+  return i - start;
+}
+
+// Add a section and end every section before it that it ends. open holds the
+// sections that haven't ended yet, from the lowest level to the highest.
+static int add_section(struct mdview_sections *sections, size_t *open,
+                       size_t *open_len, size_t start, unsigned int id,
+                       unsigned int level) {
+  if (sections->len == sections->cap) {
+    size_t cap = sections->cap ? sections->cap * 2 : 16;
+    struct mdview_section *tmp =
+        realloc(sections->sections, cap * sizeof(struct mdview_section));
+    if (!tmp) {
+      perror("realloc");
+      return 0;
+    }
+    sections->sections = tmp;
+    sections->cap = cap;
+  }
+
+  while (*open_len > 0 &&
+         sections->sections[open[*open_len - 1]].level >= level) {
+    (*open_len)--;
+    sections->sections[open[*open_len]].end = start;
+  }
+  open[(*open_len)++] = sections->len;
+
+  struct mdview_section *section = &sections->sections[sections->len++];
+  section->start = start;
+  section->end = 0;
+  section->id = id;
+  section->level = level;
+  return 1;
+}
+
+int mdview_sections_scan(struct mdview_sections *sections, const char *md,
+                         size_t len) {
+  const unsigned char *str = (const unsigned char *)md;
+  sections->sections = NULL;
+  sections->len = 0;
+  sections->cap = 0;
+
+  // sections that haven't ended, at most one per level
+  size_t open[6];
+  size_t open_len = 0;
+
+  unsigned int fence = 0;   // backticks of the open fence, 0 = none
+  int inline_code = 0;      // 1 = in inline code
+  int escaped = 0;          // 1 = the next character is escaped
+  unsigned int id_cnt = 0;  // number of headings so far
+  size_t i = 0;
+  while (i < len) {
+    // The beginning of a line. Only a heading at the beginning of a line with
+    // no indentation or markers starts a section. In code, '>', list markers,
+    // and emphasis markers are regular text.
+    size_t line = i;
+    int code = fence || inline_code;
+    for (;;) {
+      while (i < len && (str[i] == ' ' || str[i] == '\t'))
+        i++;
+      if (inline_code && !fence && i + 1 < len && str[i] == '`' &&
+          (str[i + 1] == ' ' || str[i + 1] == '\t')) {
+        // inline code that ends here, followed by whitespace, doesn't end the
+        // beginning of the line
+        inline_code = 0;
+        code = 0;
+        i++;
+        continue;
+      }
+      if (code || escaped)
+        break;
+      size_t marker = marker_len(str, i, len);
+      if (!marker)
+        marker = decoration_len(str, i, len);
+      if (!marker)
+        break;
+      i += marker;
+    }
+    if (i < len && str[i] == '\\' && !code && !escaped) {
+      escaped = 1;
+      i++;
+    }
+    if (i == len)
+      break;
+
+    if (escaped) {
+      // at the beginning of a line, an escape lasts through whitespace and
+      // through escaped backslashes and angle brackets
+      while (i < len && (str[i] == ' ' || str[i] == '\t' || str[i] == '\\' ||
+                         str[i] == '<' || str[i] == '>'))
+        i++;
+      if (i < len && str[i] != '\n') {
+        escaped = 0;
+        i++;
+      }
+    } else if (str[i] == '#' && !code) {
+      size_t level = run_len(str, i, len, '#');
+      if (level <= 6 && i + level < len && str[i + level] == ' ') {
+        id_cnt++;
+        if (i == line &&
+            !add_section(sections, open, &open_len, line, id_cnt, level)) {
+          mdview_sections_free(sections);
+          return 0;
+        }
+      }
+      i += level;
+    } else if (str[i] == '`') {
+      // a fence opens a code block, or closes one with the same number of
+      // backticks
+      size_t ticks = run_len(str, i, len, '`');
+      if (ticks >= 3) {
+        fence = fence == ticks ? 0 : ticks;
+        i += ticks;
+      }
+    }
+
+    // the rest of the line
+    while (i < len) {
+      i = next_special(str, i, len);
+      if (i == len)
+        break;
+      if (str[i] == '\n') {
+        i++;
+        break;
+      } else if (str[i] == '`') {
+        // a single backtick starts or ends inline code, outside of fences
+        size_t ticks = run_len(str, i, len, '`');
+        if (ticks == 1 && !fence)
+          inline_code = !inline_code;
+        i += ticks;
+      } else if (fence || inline_code) {
+        // backslashes are regular text in code
+        i++;
+      } else {
+        // the escaped character is regular text. otherwise, the escape carries
+        // over to the next line.
+        i = escape_end(str, i + 1, len);
+        if (i < len && str[i] != '\n')
+          i++;
+        else
+          escaped = 1;
+      }
+    }
+  }
+
+  // sections that are still open end with the document
+  for (size_t j = 0; j < open_len; j++)
+    sections->sections[open[j]].end = len;
+  return 1;
+}
+
+void mdview_sections_free(struct mdview_sections *sections) {
+  free(sections->sections);
+  sections->sections = NULL;
+  sections->len = 0;
+  sections->cap = 0;
+}
@@ -0,0 +1,257 @@
+#include "tables.h"
+#include "links.h"
+#include "mdview.h"
+#include "parser.h"
+#include "tags.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Alignments are packed 2 bits per column, so only this many columns can be
+// aligned. Columns past this are still rendered, just without alignment.
+#define TABLE_ALIGN_COLS (sizeof(unsigned long long) * 4)
+
+int table_start(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = get_scratch(ctx);
+  if (!scratch)
+    return 0;
+  ctx->table_pending = 1;
+  ctx->slow_path = 1;
+  scratch->table_head_len = 0;
+  bufclear(&scratch->table_buf);
+  return bufadd(&scratch->table_buf, '|');
+}
+
+// Count the cells of the buffered header row. The row always starts with a
+// '|', and escaped pipes don't split cells.
+static unsigned int count_head_cells(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  const char *row = scratch->table_buf.buf;
+  size_t len = scratch->table_head_len - 1; // don't count the newline
+  unsigned int pipes = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (row[i] == '\\')
+      i++;
+    else if (row[i] == '|')
+      pipes++;
+  }
+
+  // a trailing pipe doesn't start another cell
+  while (len > 0 && (row[len - 1] == ' ' || row[len - 1] == '\t'))
+    len--;
+  if (len > 1 && row[len - 1] == '|' && row[len - 2] != '\\')
+    pipes--;
+  return pipes;
+}
+
+// Parse the buffered delimiter row into the scratch space's table_cols and
+// table_align. Returns 0 if it isn't a valid delimiter row.
+static int parse_delimiter_row(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  const char *row = scratch->table_buf.buf + scratch->table_head_len;
+  const char *end = scratch->table_buf.buf + scratch->table_buf.len;
+
+  // skip the leading pipe, if any
+  while (row < end && (*row == ' ' || *row == '\t'))
+    row++;
+  if (row < end && *row == '|')
+    row++;
+
+  scratch->table_cols = 0;
+  scratch->table_align = 0;
+  while (row < end) {
+    int left = 0, right = 0, dashes = 0;
+    while (row < end && (*row == ' ' || *row == '\t'))
+      row++;
+    if (row == end)
+      break; // trailing pipe
+    if (*row == ':') {
+      left = 1;
+      row++;
+    }
+    while (row < end && *row == '-') {
+      dashes++;
+      row++;
+    }
+    if (row < end && *row == ':') {
+      right = 1;
+      row++;
+    }
+    while (row < end && (*row == ' ' || *row == '\t'))
+      row++;
+    if (!dashes || (row < end && *row != '|'))
+      return 0;
+    row++;
+
+    if (scratch->table_cols < TABLE_ALIGN_COLS) {
+      unsigned long long align = right ? (left ? 2 : 3) : left;
+      scratch->table_align |= align << (2 * scratch->table_cols);
+    }
+    scratch->table_cols++;
+  }
+  return scratch->table_cols > 0;
+}
+
+// Handle the buffered markdown. If as_table is 0, then it is handled as if it
+// never could have been a table. The buffer is detached first because handling
+// it might start another pending table (ie: if the delimiter row is actually
+// another header row).
+static int replay_pending(struct mdview_ctx *ctx, int as_table) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  struct mdview_buf replay = scratch->table_buf;
+  scratch->table_buf.buf = NULL;
+  scratch->table_buf.len = 0;
+  scratch->table_buf.cap = 0;
+  ctx->table_pending = 0;
+
+  // the leading '|' would start another pending table, so bypass it. the
+  // buffered markdown isn't where ctx->in_pos is.
+  const char *in_pos = ctx->in_pos;
+  ctx->in_pos = NULL;
+  int success = as_table ? 1 : handle_regular_char(ctx, '|');
+  for (size_t i = as_table ? 0 : 1; success && i < replay.len; i++)
+    success = handle_char(ctx, replay.buf[i]);
+  ctx->in_pos = in_pos;
+
+  // give the buffer back, unless a new one is being used
+  if (!scratch->table_buf.buf) {
+    scratch->table_buf = replay;
+    bufclear(&scratch->table_buf);
+  } else {
+    free(replay.buf);
+  }
+  return success;
+}
+
+// The delimiter row is valid, so start the table and write the header row.
+static int confirm_table(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  if (!block_table(ctx))
+    return 0;
+  ctx->table_cell = 0;
+  scratch->table_col = 0;
+
+  // the header row is handled like any other row, and the delimiter row is
+  // dropped.
+  scratch->table_buf.len = scratch->table_head_len;
+  return replay_pending(ctx, 1);
+}
+
+int table_pending_char(struct mdview_ctx *ctx, char ch) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  if (ctx->table_pending == 1) {
+    // buffer the header row. it will be validated by the delimiter row.
+    if (!bufadd(&scratch->table_buf, ch))
+      return 0;
+    if (ch == '\n') {
+      scratch->table_head_len = scratch->table_buf.len;
+      ctx->table_pending = 2;
+    }
+    return 1;
+  }
+
+  if (ch == '\n') {
+    if (parse_delimiter_row(ctx) &&
+        scratch->table_cols == count_head_cells(ctx))
+      return confirm_table(ctx);
+    if (!replay_pending(ctx, 0))
+      return 0;
+    return handle_char(ctx, ch);
+  }
+
+  // a delimiter row can only contain these characters
+  if (!strchr("|-: \t", ch)) {
+    if (!replay_pending(ctx, 0))
+      return 0;
+    return handle_char(ctx, ch);
+  }
+  return bufadd(&scratch->table_buf, ch);
+}
+
+int end_table_pending(struct mdview_ctx *ctx) {
+  if (ctx->table_pending == 2 && parse_delimiter_row(ctx) &&
+      ctx->scratch->table_cols == count_head_cells(ctx))
+    return confirm_table(ctx);
+  if (ctx->table_pending)
+    return replay_pending(ctx, 0);
+  return 1;
+}
+
+int table_open_cell(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  static const char *const aligns[] = {"", " align=\"left\"",
+                                       " align=\"center\"",
+                                       " align=\"right\""};
+  unsigned int align = 0;
+  if (scratch->table_col < TABLE_ALIGN_COLS)
+    align = (scratch->table_align >> (2 * scratch->table_col)) & 3;
+
+  ctx->table_cell = 2;
+  scratch->table_col++;
+  return bufcat(&ctx->html_out, ctx->block_subtype ? "<th" : "<td", 3) &&
+         bufcat(&ctx->html_out, (char *)aligns[align], strlen(aligns[align])) &&
+         bufadd(&ctx->html_out, '>');
+}
+
+int table_cell_space(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  for (; scratch->table_space > 0; scratch->table_space--) {
+    if (!bufadd(&ctx->html_out, ' '))
+      return 0;
+  }
+  return 1;
+}
+
+// Close the current cell. Links and decorations can't span cells, and
+// whitespace at the end of the cell is dropped.
+static int table_close_cell(struct mdview_ctx *ctx) {
+  if (!end_link(ctx) || !end_all_decorations(ctx))
+    return 0;
+  ctx->scratch->table_space = 0;
+  ctx->table_cell = 1;
+  return bufcat(&ctx->html_out, ctx->block_subtype ? "</th>" : "</td>", 5);
+}
+
+int table_pipe(struct mdview_ctx *ctx) {
+  ctx->line_start = 0;
+  switch (ctx->table_cell) {
+  case 0:
+    // start a new row
+    ctx->table_cell = 1;
+    ctx->scratch->table_col = 0;
+    return bufcat(&ctx->html_out, "<tr>", 4);
+  case 1:
+    // empty cell
+    if (!table_open_cell(ctx))
+      return 0;
+    // fallthrough
+  default:
+    return table_close_cell(ctx);
+  }
+}
+
+int table_end_row(struct mdview_ctx *ctx) {
+  struct mdview_scratch *scratch = ctx->scratch;
+  if (ctx->table_cell == 0)
+    return 1;
+  if (ctx->table_cell == 2 && !table_close_cell(ctx))
+    return 0;
+
+  // add any missing cells
+  while (scratch->table_col < scratch->table_cols) {
+    if (!table_open_cell(ctx) || !table_close_cell(ctx))
+      return 0;
+  }
+
+  ctx->table_cell = 0;
+  scratch->table_col = 0;
+  if (!bufcat(&ctx->html_out, "</tr>\n", 6))
+    return 0;
+
+  // the first row is the header
+  if (ctx->block_subtype) {
+    ctx->block_subtype = 0;
+    return bufcat(&ctx->html_out, "</thead>\n<tbody>\n", 17);
+  }
+  return 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "mdview.h"
+
+// Start buffering a possible table. This is called for a '|' at the beginning
+// of a line outside of a table.
+int table_start(struct mdview_ctx *ctx);
+
+// Handle a character while a possible table's header and delimiter rows are
+// being buffered. Once the delimiter row ends, the table is either started and
+// the header row is written, or the buffered markdown is handled as regular
+// markdown.
+int table_pending_char(struct mdview_ctx *ctx, char ch);
+
+// End a pending table at the end of the document. This is called by
+// mdview_flush().
+int end_table_pending(struct mdview_ctx *ctx);
+
+// Handle a '|' inside of a table. This starts a row or ends the current cell.
+int table_pipe(struct mdview_ctx *ctx);
+
+// Open the next cell if a '|' was just handled. Called before text is written.
+int table_open_cell(struct mdview_ctx *ctx);
+
+// Write the whitespace that was held back in the current cell, now that more
+// text follows it.
+int table_cell_space(struct mdview_ctx *ctx);
+
+// End the current row, if any, adding empty cells for missing columns.
+int table_end_row(struct mdview_ctx *ctx);
@@ -1,5 +1,9 @@
 #include "tags.h"
+#include "anchors.h"
+#include "highlight.h"
+#include "links.h"
 #include "mdview.h"
+#include "tables.h"
 #include "util.h"
 #include <stdio.h>
 #include <string.h>
@@ -9,10 +13,8 @@
  */
 
 #define TOGGLE_DECORATION(bit, tag)                                            \
-  if (ctx->block_type == -1) {                                                 \
-    if (!block_paragraph(ctx))                                                 \
-      return 0;                                                                \
-  }                                                                            \
+  if (!open_text(ctx))                                                         \
+    return 0;                                                                  \
   if (ctx->text_decoration & (1 << bit)) {                                     \
     if (!bufcat(ctx->curr_buf, "</" tag ">", 3 + sizeof(tag) - 1))             \
       return 0;                                                                \
@@ -54,7 +56,7 @@ int end_all_decorations(struct mdview_ctx *ctx) {
       return 0;
   }
   if (ctx->text_decoration & (1 << 5)) {
-    if (!toggle_sub(ctx))
+    if (!toggle_sup(ctx))
       return 0;
   }
   return 1;
@@ -64,9 +66,42 @@ int end_all_decorations(struct mdview_ctx *ctx) {
  * Blocks
  */
 
+// Number of open blocks, including the current one. Level 0 is the outermost
+// block, and the current block is the last level.
+static inline unsigned int open_blocks(struct mdview_ctx *ctx) {
+  return ctx->block_depth + (ctx->block_type != -1);
+}
+
+static inline int level_type(struct mdview_ctx *ctx, unsigned int level) {
+  if (level < ctx->block_depth)
+    return ctx->scratch->block_stack[level].type;
+  return ctx->block_type;
+}
+
+static inline unsigned int level_subtype(struct mdview_ctx *ctx,
+                                         unsigned int level) {
+  if (level < ctx->block_depth)
+    return ctx->scratch->block_stack[level].subtype;
+  return ctx->block_subtype;
+}
+
+// Lines (and list items) indented at least this far past a list item's marker
+// are nested inside of that list item.
+#define LIST_CONTENT_INDENT 2
+
+// Returns 1 if the list at this level is continued by the current line's
+// indentation.
+static inline int list_continued(struct mdview_ctx *ctx, unsigned int level) {
+  int type = level_type(ctx, level);
+  return (type == 7 || type == 8) &&
+         ctx->indent >= (level_subtype(ctx, level) >> 8) + LIST_CONTENT_INDENT;
+}
+
 static inline int close_header_block(struct mdview_ctx *ctx) {
+  if (ctx->indexing && !index_heading(ctx))
+    return 0;
   char header_tag[6] = {'<', '/', 'h', '0' + ctx->block_type, '>', '\n'};
-  return bufcat(ctx->curr_buf, header_tag, 6);
+  return bufcat(&ctx->html_out, header_tag, 6);
 }
 
 int close_block(struct mdview_ctx *ctx) {
@@ -90,14 +125,21 @@ int close_block(struct mdview_ctx *ctx) {
     retval = bufcat(&ctx->html_out, "</li>\n</ul>\n", 12);
     break;
   case 8:
-    retval = bufcat(&ctx->html_out, "\n</ol>\n", 7);
+    retval = bufcat(&ctx->html_out, "</li>\n</ol>\n", 12);
     break;
   case 9:
-    retval = bufcat(&ctx->html_out, "</code></pre>\n", 14);
+    retval = end_code_info(ctx) && highlight_end(ctx) &&
+             bufcat(&ctx->html_out, "</code></pre>\n", 14);
     break;
   case 10:
     retval = bufcat(&ctx->html_out, "\n</blockquote>\n", 15);
     break;
+  case 11:
+    retval = table_end_row(ctx) &&
+             (ctx->block_subtype
+                  ? bufcat(&ctx->html_out, "</thead>\n</table>\n", 18)
+                  : bufcat(&ctx->html_out, "</tbody>\n</table>\n", 18));
+    break;
   default:
     fprintf(stderr, "Failed to close nonexistant block type %d\n",
             ctx->block_type);
@@ -105,37 +147,141 @@ int close_block(struct mdview_ctx *ctx) {
     break;
   }
 
-  ctx->block_type = -1;
-  ctx->block_subtype = 0;
+  // go back to the block that contained this one, if any
+  if (ctx->block_depth > 0) {
+    struct mdview_block *outer = &ctx->scratch->block_stack[--ctx->block_depth];
+    ctx->block_type = outer->type;
+    ctx->block_subtype = outer->subtype;
+  } else {
+    ctx->block_type = -1;
+    ctx->block_subtype = 0;
+  }
+  if (ctx->line_depth > open_blocks(ctx))
+    ctx->line_depth = open_blocks(ctx);
   return retval;
 }
 
+int close_all_blocks(struct mdview_ctx *ctx) {
+  while (ctx->block_type != -1) {
+    if (!close_block(ctx))
+      return 0;
+  }
+  return 1;
+}
+
+// Close blocks until only the given number of levels are open.
+static int close_blocks_to(struct mdview_ctx *ctx, unsigned int levels) {
+  while (open_blocks(ctx) > levels) {
+    if (!close_block(ctx))
+      return 0;
+  }
+  return 1;
+}
+
+// Close every block the current line doesn't continue, so that a new block can
+// be opened inside of what is left. Quotes are only continued by '>' markers
+// (counted in ctx->line_depth) and lists by indentation. Any other block is
+// always closed.
+static int close_unmatched(struct mdview_ctx *ctx) {
+  unsigned int level = ctx->line_depth;
+  while (level < open_blocks(ctx) && list_continued(ctx, level))
+    level++;
+  ctx->line_depth = level;
+  return close_blocks_to(ctx, level);
+}
+
+// Make a new block the current block, keeping the old one open around it. If
+// the stack is full, then the outer blocks are closed to make room, which
+// flattens anything nested deeper than MDVIEW_BLOCK_DEPTH. The stack is in the
+// scratch space, so it is only allocated once a block is nested.
+static int push_block(struct mdview_ctx *ctx, int type, unsigned int subtype) {
+  if (ctx->block_type != -1) {
+    struct mdview_scratch *scratch = get_scratch(ctx);
+    if (!scratch)
+      return 0;
+    while (ctx->block_depth == MDVIEW_BLOCK_DEPTH) {
+      if (!close_block(ctx))
+        return 0;
+    }
+    scratch->block_stack[ctx->block_depth].type = ctx->block_type;
+    scratch->block_stack[ctx->block_depth].subtype = ctx->block_subtype;
+    ctx->block_depth++;
+  }
+  ctx->block_type = type;
+  ctx->block_subtype = subtype;
+  ctx->line_depth = open_blocks(ctx);
+  return 1;
+}
+
 // NOTE: blocks always write to ctx->html_out, NOT wherever ctx->curr_buf is
-// pointing. This means that if you can't change blocks while buffering!
+// pointing. This means that if you can't change blocks while buffering! Blocks
+// that start a line end a pending link first, so it is written as text in the
+// block it started in.
 #define BLOCK_TAG(type, subtype, tag)                                          \
-  if (!close_block(ctx))                                                       \
-    return 1;                                                                  \
-  ctx->block_type = type;                                                      \
-  ctx->block_subtype = subtype;                                                \
+  if (!close_unmatched(ctx) || !push_block(ctx, type, subtype))                \
+    return 0;                                                                  \
   return bufcat(&ctx->html_out, "<" tag ">\n", 3 + sizeof(tag) - 1);
 
 int block_paragraph(struct mdview_ctx *ctx) { BLOCK_TAG(0, 0, "p") }
+
+// Lists are only opened by list_item(), which closes the blocks they replace.
 int block_unordered_list(struct mdview_ctx *ctx, char starter) {
-  unsigned int subtype = (ctx->indent << 8 | starter);
-  BLOCK_TAG(7, subtype, "ul")
+  unsigned int indent = ctx->indent < 255 ? ctx->indent : 255;
+  if (!push_block(ctx, 7, indent << 8 | (unsigned char)starter))
+    return 0;
+  return bufcat(&ctx->html_out, "<ul>\n", 5);
 }
+int block_ordered_list(struct mdview_ctx *ctx, char delim, unsigned int start) {
+  unsigned int indent = ctx->indent < 255 ? ctx->indent : 255;
+  if (!push_block(ctx, 8, indent << 8 | (unsigned char)delim))
+    return 0;
+  if (start == 1)
+    return bufcat(&ctx->html_out, "<ol>\n", 5);
 
-// TODO: ordered list
-// int block_ordered_list(struct mdview_ctx *ctx) { BLOCK_TAG(8, 0, "ol")
-// }
+  char open_tag[32];
+  int len = snprintf(open_tag, sizeof(open_tag), "<ol start=\"%u\">\n", start);
+  return bufcat(&ctx->html_out, open_tag, len);
+}
+int block_table(struct mdview_ctx *ctx) { BLOCK_TAG(11, 1, "table>\n<thead") }
 int block_code(struct mdview_ctx *ctx, unsigned int fence_len) {
-  BLOCK_TAG(9, fence_len, "pre><code")
+  struct mdview_scratch *scratch = get_scratch(ctx);
+  if (!scratch)
+    return 0;
+  // a pending link is written as text before the fence, because the <code>
+  // tag and its info string have to be written to the same buffer
+  if (!end_link(ctx) || !close_unmatched(ctx) ||
+      !push_block(ctx, 9, fence_len))
+    return 0;
+
+  // the <code> tag is finished by end_code_info() once the info string is read
+  ctx->code_info = 1;
+  scratch->code_indent = ctx->indent;
+  ctx->hl_word_len = 0;
+  return bufcat(&ctx->html_out, "<pre><code", 10);
+}
+int block_quote(struct mdview_ctx *ctx) {
+  // each '>' on a line continues the next quote, if it is still open
+  unsigned int level = ctx->line_depth;
+  while (level < open_blocks(ctx) && list_continued(ctx, level))
+    level++;
+  if (level < open_blocks(ctx) && level_type(ctx, level) == 10) {
+    ctx->line_depth = level + 1;
+  } else {
+    if (!end_link(ctx) || !close_unmatched(ctx) ||
+        !push_block(ctx, 10, 0) ||
+        !bufcat(&ctx->html_out, "<blockquote>\n", 13))
+      return 0;
+  }
+
+  // indentation is counted from after the marker
+  ctx->indent = 0;
+  return 1;
 }
-int block_quote(struct mdview_ctx *ctx) { BLOCK_TAG(10, 0, "blockquote") }
 int block_header(struct mdview_ctx *ctx, int level) {
-  close_block(ctx);
-  ctx->block_type = level;
-  ctx->block_subtype = 0;
+  if (!end_link(ctx) || !close_unmatched(ctx) || !push_block(ctx, level, 0))
+    return 0;
+  // the rest of the line is the header's text, not more blocks
+  ctx->line_start = 0;
 
   // get a unique ID by incrementing the counter
   ctx->id_cnt++;
@@ -148,35 +294,72 @@ int block_header(struct mdview_ctx *ctx, int level) {
 
   char open_tag[11 + n_len];
   snprintf(open_tag, 11 + n_len, "<h%d id=\"%u\">", level, ctx->id_cnt);
-  return bufcat(&ctx->html_out, open_tag, 10 + n_len);
+  if (!bufcat(&ctx->html_out, open_tag, 10 + n_len))
+    return 0;
+  ctx->heading_start = ctx->html_out.len;
+  return 1;
 }
 
 /*
  * Functions unrelated to decorations or blocks.
  */
 
-int unordered_list_item(struct mdview_ctx *ctx, char starter) {
-  if (ctx->block_type != 7 || (char)ctx->block_subtype != starter) {
-    // if we're not in an unordered list or the starter is different, start a
-    // new unordered one
-    if (!block_unordered_list(ctx, starter))
-      return 0;
-  } else {
-    // otherwise we need to close the last list item
-    if (!bufcat(ctx->curr_buf, "</li>\n", 6))
-      return 0;
+int list_item(struct mdview_ctx *ctx, int type, char starter,
+              unsigned int start) {
+  if (!end_link(ctx))
+    return 0;
+
+  // find the list this item belongs to. items indented past a list's marker
+  // are nested inside of it, and items of the same kind at about the same
+  // indentation are in it.
+  unsigned int level = ctx->line_depth;
+  while (level < open_blocks(ctx)) {
+    if (list_continued(ctx, level)) {
+      level++;
+      continue;
+    }
+
+    unsigned int subtype = level_subtype(ctx, level);
+    if (level_type(ctx, level) == type && (char)subtype == starter &&
+        ctx->indent >= subtype >> 8) {
+      // another item in this list. close the last item.
+      if (!close_blocks_to(ctx, level + 1))
+        return 0;
+      ctx->line_depth = level + 1;
+      return bufcat(&ctx->html_out, "</li>\n<li>", 10);
+    }
+    break;
   }
 
-  if (!bufcat(ctx->curr_buf, "<li>", 4))
+  // otherwise, this item starts a new list
+  if (!close_blocks_to(ctx, level))
     return 0;
-  return 1;
+  if (type == 7 ? !block_unordered_list(ctx, starter)
+                : !block_ordered_list(ctx, starter, start))
+    return 0;
+  return bufcat(&ctx->html_out, "<li>", 4);
 }
 
-int write_link(struct mdview_ctx *ctx, char *url, char *text) {
-  if (ctx->block_type == -1) {
-    if (!block_paragraph(ctx))
+int open_text(struct mdview_ctx *ctx) {
+  switch (ctx->block_type) {
+  case -1:
+    return block_paragraph(ctx);
+  case 11:
+    // text right after a '|' opens the next cell, and text at the beginning
+    // of a line starts a row without a leading '|'
+    if (ctx->table_cell == 0 && !table_pipe(ctx))
       return 0;
+    if (ctx->table_cell == 1)
+      return table_open_cell(ctx);
+    return table_cell_space(ctx);
+  default:
+    return 1;
   }
+}
+
+int write_link(struct mdview_ctx *ctx, char *url, char *text) {
+  if (!open_text(ctx))
+    return 0;
 
   if (ctx->image_link) {
     return bufcat(ctx->curr_buf, "<img src=\"", 10) &&
@@ -185,8 +368,7 @@ int write_link(struct mdview_ctx *ctx, char *url, char *text) {
            bufcat(ctx->curr_buf, text, strlen(text)) &&
            bufcat(ctx->curr_buf, "\" />", 4);
   }
-  return bufcat(ctx->curr_buf, "<a href=\"", 9) &&
-         bufcat(ctx->curr_buf, url, strlen(url)) &&
+  return bufcat(ctx->curr_buf, "<a href=\"", 9) && write_link_url(ctx, url) &&
          bufcat(ctx->curr_buf, "\">", 2) &&
          bufcat(ctx->curr_buf, text, strlen(text)) &&
          bufcat(ctx->curr_buf, "</a>", 4);
@@ -21,19 +21,34 @@ int end_all_decorations(struct mdview_ctx *ctx);
  * Blocks
  */
 
-// Close the current block
+// Close the current block. The block that contained it, if any, becomes the
+// current block again.
 int close_block(struct mdview_ctx *ctx);
 
-// Open a new block (closes the current one with close_block)
+// Close every open block. This is called on blank lines and by mdview_flush()
+int close_all_blocks(struct mdview_ctx *ctx);
+
+// Open a new block. Blocks that the current line doesn't continue are closed
+// first, and the new block is nested inside of any lists or quotes that are
+// left.
 int block_paragraph(struct mdview_ctx *ctx);
 int block_unordered_list(struct mdview_ctx *ctx, char starter);
-int block_ordered_list(struct mdview_ctx *ctx);
+int block_ordered_list(struct mdview_ctx *ctx, char delim, unsigned int start);
+int block_table(struct mdview_ctx *ctx);
 int block_code(struct mdview_ctx *ctx, unsigned int fence_len);
 int block_quote(struct mdview_ctx *ctx);
 int block_header(struct mdview_ctx *ctx, int level);
 
-// Create a new unordered list item and calls block_unordered_list() if needed
-int unordered_list_item(struct mdview_ctx *ctx, char starter);
+// Make sure there is somewhere to write text to. This starts a paragraph if
+// there is no block, and opens the next cell in tables.
+int open_text(struct mdview_ctx *ctx);
+
+// Create a new list item of the given block type (7 = unordered, 8 = ordered)
+// and start a new list if needed. The starter is the item's marker ('-', '+',
+// or '*') or, for ordered lists, the character after the number ('.' or ')').
+// start is the number of an ordered list item.
+int list_item(struct mdview_ctx *ctx, int type, char starter,
+              unsigned int start);
 
 // Write the currently
 int write_link(struct mdview_ctx *ctx, char *url, char *text);
@@ -0,0 +1,362 @@
+#include "utf8.h"
+#include "mdview.h"
+#include "parser.h"
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// Whole blocks of multibyte text are validated with SSSE3 if the CPU has it.
+// It is enabled for just that function, so the library still runs anywhere.
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <tmmintrin.h>
+#define UTF8_SSSE3 1
+#endif
+
+// Returns 1 if the byte is plain text that can be handled as-is: printable
+// ASCII, tab, newline, or carriage return.
+static inline int is_text_byte(unsigned char b) {
+  return (b >= 0x20 && b < 0x7f) || b == '\n' || b == '\t' || b == '\r';
+}
+
+// Returns the length of the code point at the beginning of the string if it is
+// plain text, or 0 if it isn't (or if it is cut off).
+static size_t text_char(const unsigned char *str, size_t len) {
+  unsigned char b = str[0];
+  if (b < 0x80)
+    return is_text_byte(b);
+
+  // the same rules as utf8_byte()
+  size_t need;
+  unsigned char lo = 0x80, hi = 0xbf;
+  if (b >= 0xc2 && b <= 0xdf)
+    need = 2;
+  else if (b >= 0xe0 && b <= 0xef)
+    need = 3;
+  else if (b >= 0xf0 && b <= 0xf4)
+    need = 4;
+  else
+    return 0;
+  if (len < need)
+    return 0;
+  if (b == 0xe0)
+    lo = 0xa0;
+  else if (b == 0xed)
+    hi = 0x9f;
+  else if (b == 0xf0)
+    lo = 0x90;
+  else if (b == 0xf4)
+    hi = 0x8f;
+  if (str[1] < lo || str[1] > hi)
+    return 0;
+  for (size_t i = 2; i < need; i++) {
+    if (str[i] < 0x80 || str[i] > 0xbf)
+      return 0;
+  }
+  return need;
+}
+
+#ifdef UTF8_SSSE3
+// Returns the length of the whole 16-byte blocks at the beginning of the
+// string that are plain text, backed up to the start of a code point. This
+// uses the lookup tables from "Validating UTF-8 In Less Than One Instruction
+// Per Byte" (Keiser and Lemire, 2021): the high and low nibbles of each byte
+// and the high nibble of the byte after it each select a set of errors, and a
+// byte pair is invalid if all three sets share one. Lead bytes of 3 and 4
+// byte code points are checked against the bytes 2 and 3 after them.
+__attribute__((target("ssse3"))) static size_t
+text_blocks_ssse3(const unsigned char *str, size_t len) {
+  // errors for a pair of bytes
+  enum {
+    TOO_SHORT = 1 << 0,  // lead byte or ASCII, then a lead byte or ASCII
+    TOO_LONG = 1 << 1,   // ASCII, then a continuation
+    OVERLONG_3 = 1 << 2, // 0xe0, then 0x80-0x9f
+    TOO_LARGE = 1 << 3,  // 0xf4, then 0x90-0xbf, or 0xf5-0xff
+    SURROGATE = 1 << 4,  // 0xed, then 0xa0-0xbf
+    OVERLONG_2 = 1 << 5, // 0xc0 or 0xc1, then a continuation
+    TOO_LARGE_1000 = 1 << 6, // 0xf5-0xff, then 0x80-0x8f
+    OVERLONG_4 = 1 << 6,     // 0xf0, then 0x80-0x8f
+    TWO_CONTS = 1 << 7,      // two continuations (checked below)
+    CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS,
+  };
+  static const unsigned char tables[3][16] = {
+      // the high nibble of the first byte
+      {TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+       TOO_LONG, TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+       TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE,
+       TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4},
+      // the low nibble of the first byte
+      {CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY,
+       CARRY, CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000,
+       CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+       CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+       CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+       CARRY | TOO_LARGE | TOO_LARGE_1000,
+       CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+       CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000},
+      // the high nibble of the second byte
+      {TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+       TOO_SHORT, TOO_SHORT,
+       TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+           OVERLONG_4,
+       TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+       TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+       TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_SHORT,
+       TOO_SHORT, TOO_SHORT, TOO_SHORT}};
+  const __m128i byte_1_high = _mm_loadu_si128((const __m128i *)tables[0]);
+  const __m128i byte_1_low = _mm_loadu_si128((const __m128i *)tables[1]);
+  const __m128i byte_2_high = _mm_loadu_si128((const __m128i *)tables[2]);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r');
+
+  // the run starts at the start of a code point, so the byte before it is
+  // like ASCII
+  __m128i prev = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+    __m128i prev1 = _mm_alignr_epi8(v, prev, 15);
+    __m128i errors = _mm_and_si128(
+        _mm_and_si128(
+            _mm_shuffle_epi8(byte_1_high,
+                             _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte_2_high,
+                         _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+
+    // the third and fourth bytes of a code point must be continuations, and
+    // only they can be a second continuation in a row
+    __m128i third = _mm_subs_epu8(_mm_alignr_epi8(v, prev, 14),
+                                  _mm_set1_epi8((char)(0xe0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(v, prev, 13),
+                                   _mm_set1_epi8((char)(0xf0 - 0x80)));
+    __m128i must_be_cont =
+        _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+    errors = _mm_xor_si128(errors, must_be_cont);
+
+    // control characters are never plain text. bytes >= 0x80 are negative as
+    // signed chars, so they are left out of the compare with 0x20.
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                              _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                           _mm_cmpeq_epi8(v, cr)));
+    __m128i ctrl = _mm_andnot_si128(
+        _mm_or_si128(ws, _mm_cmplt_epi8(v, _mm_setzero_si128())),
+        _mm_cmplt_epi8(v, space));
+    errors = _mm_or_si128(errors, _mm_or_si128(ctrl, _mm_cmpeq_epi8(v, del)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) !=
+        0xffff)
+      break;
+    prev = v;
+  }
+
+  // the last block might end in the middle of a code point, which hasn't been
+  // checked against the bytes after it yet
+  for (size_t back = 1; back <= 3 && back <= i; back++) {
+    unsigned char b = str[i - back];
+    if (b < 0x80)
+      break;
+    if (b >= 0xc0)
+      return back < (b >= 0xf0 ? 4u : b >= 0xe0 ? 3u : 2u) ? i - back : i;
+  }
+  return i;
+}
+
+// Returns 1 if the CPU has SSSE3. This is only checked once.
+static int have_ssse3(void) {
+  static int have = -1;
+  if (have < 0)
+    have = __builtin_cpu_supports("ssse3") != 0;
+  return have;
+}
+#endif
+
+// Returns the length of the whole blocks of ASCII plain text at the beginning
+// of the string.
+static size_t ascii_blocks(const unsigned char *str, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // check 16 bytes at a time. bytes >= 0x80 are negative as signed chars, so
+  // the signed compare with 0x20 catches them along with control characters.
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                              _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                           _mm_cmpeq_epi8(v, cr)));
+    __m128i bad = _mm_or_si128(_mm_andnot_si128(ws, _mm_cmplt_epi8(v, space)),
+                               _mm_cmpeq_epi8(v, del));
+    if (_mm_movemask_epi8(bad))
+      break;
+  }
+#else
+  // check 8 bytes at a time. a word with any byte outside of 0x20-0x7e (this
+  // includes newlines) is checked byte by byte.
+  const uint64_t ones = 0x0101010101010101ull;
+  const uint64_t highs = 0x8080808080808080ull;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, str + i, 8);
+    uint64_t below_space = (w - ones * 0x20) & ~w;
+    uint64_t is_del = ((w ^ (ones * 0x7f)) - ones) & ~(w ^ (ones * 0x7f));
+    if ((w | below_space | is_del) & highs)
+      break;
+  }
+#endif
+  return i;
+}
+
+// Returns the number of plain text bytes at the beginning of the string, which
+// only ever ends with a whole code point. Blocks of text are checked at once,
+// and only the code points between them are checked one at a time.
+static size_t text_run(const unsigned char *str, size_t len) {
+  size_t i = 0;
+  for (;;) {
+#ifdef UTF8_SSSE3
+    if (have_ssse3())
+      i += text_blocks_ssse3(str + i, len - i);
+    else
+#endif
+      i += ascii_blocks(str + i, len - i);
+    if (i == len)
+      return i;
+    size_t n = text_char(str + i, len - i);
+    if (!n)
+      return i;
+    i += n;
+  }
+}
+
+// Handle bytes that aren't valid text according to the policy.
+static int invalid_bytes(struct mdview_ctx *ctx, const unsigned char *bytes,
+                         size_t len) {
+  switch (ctx->utf8_policy) {
+  case 1:
+    // one replacement character for the whole invalid sequence
+    return handle_char(ctx, (char)0xef) && handle_char(ctx, (char)0xbf) &&
+           handle_char(ctx, (char)0xbd);
+  case 2:
+    ctx->error_msg = len == 1 && bytes[0] < 0x80
+                         ? "control character in input"
+                         : "invalid UTF-8 in input";
+    return 0;
+  default:
+    for (size_t i = 0; i < len; i++) {
+      if (!handle_char(ctx, (char)bytes[i]))
+        return 0;
+    }
+    return 1;
+  }
+}
+
+// Handle a byte that isn't plain ASCII text, one byte at a time.
+static int utf8_byte(struct mdview_ctx *ctx, unsigned char b) {
+  if (ctx->utf8_len == 0) {
+    // control characters
+    if (b < 0x80)
+      return is_text_byte(b) ? handle_char(ctx, (char)b)
+                             : invalid_bytes(ctx, &b, 1);
+
+    // the first byte of a code point gives its length. 0xc0, 0xc1, and
+    // 0xf5-0xff can never be the first byte.
+    if (b >= 0xc2 && b <= 0xdf)
+      ctx->utf8_need = 2;
+    else if (b >= 0xe0 && b <= 0xef)
+      ctx->utf8_need = 3;
+    else if (b >= 0xf0 && b <= 0xf4)
+      ctx->utf8_need = 4;
+    else
+      return invalid_bytes(ctx, &b, 1);
+    ctx->utf8_buf[ctx->utf8_len++] = b;
+    return 1;
+  }
+
+  // The second byte has a smaller range after some first bytes, which rules
+  // out overlong encodings, surrogates, and code points past U+10FFFF.
+  unsigned char lo = 0x80, hi = 0xbf;
+  if (ctx->utf8_len == 1) {
+    switch (ctx->utf8_buf[0]) {
+    case 0xe0:
+      lo = 0xa0;
+      break;
+    case 0xed:
+      hi = 0x9f;
+      break;
+    case 0xf0:
+      lo = 0x90;
+      break;
+    case 0xf4:
+      hi = 0x8f;
+      break;
+    }
+  }
+
+  if (b < lo || b > hi) {
+    // the code point ended early. this byte might start the next one.
+    size_t len = ctx->utf8_len;
+    ctx->utf8_len = 0;
+    if (!invalid_bytes(ctx, ctx->utf8_buf, len))
+      return 0;
+    return utf8_byte(ctx, b);
+  }
+
+  ctx->utf8_buf[ctx->utf8_len++] = b;
+  if (ctx->utf8_len < ctx->utf8_need)
+    return 1;
+
+  // the code point is complete and valid
+  size_t len = ctx->utf8_len;
+  ctx->utf8_len = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (!handle_char(ctx, (char)ctx->utf8_buf[i]))
+      return 0;
+  }
+  return 1;
+}
+
+int utf8_feed(struct mdview_ctx *ctx, const char *md, size_t len) {
+  const unsigned char *str = (const unsigned char *)md;
+
+  size_t i = 0;
+  while (i < len) {
+    // plain text is handled without any more checks
+    if (ctx->utf8_len == 0) {
+      size_t run = text_run(str + i, len - i);
+      for (size_t end = i + run; i < end; i++) {
+        ctx->in_pos = md + i;
+        if (!handle_char(ctx, (char)str[i]))
+          return 0;
+      }
+      if (i == len)
+        break;
+    }
+
+    // the bytes of a code point are handled once it is complete
+    ctx->in_pos = NULL;
+    if (!utf8_byte(ctx, str[i]))
+      return 0;
+    i++;
+  }
+  return 1;
+}
+
+int end_utf8(struct mdview_ctx *ctx) {
+  if (ctx->utf8_len == 0)
+    return 1;
+  size_t len = ctx->utf8_len;
+  ctx->utf8_len = 0;
+  if (ctx->utf8_policy == 2) {
+    ctx->error_msg = "input ended in the middle of a UTF-8 code point";
+    return 0;
+  }
+  return invalid_bytes(ctx, ctx->utf8_buf, len);
+}
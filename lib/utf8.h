@@ -0,0 +1,14 @@
+#pragma once
+
+#include "mdview.h"
+
+// Validate len bytes of markdown and handle every character of them with
+// handle_char().
+// Invalid UTF-8 and control characters are handled according to
+// ctx->utf8_policy. Code points split between feeds are kept in the context
+// until the rest of them is fed.
+int utf8_feed(struct mdview_ctx *ctx, const char *md, size_t len);
+
+// Handle a code point that was never finished because the input ended. This is
+// called by mdview_flush().
+int end_utf8(struct mdview_ctx *ctx);
@@ -3,14 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Size of a buffer when it is first allocated.
+#define BUF_MIN_CAP 64
+
 int bufadd(struct mdview_buf *buf, char ch) {
   // make sure there is enough space in the buffer
   while (buf->len + 1 >= buf->cap) {
-    // if we haven't used this buffer before, then make it the default size
-    if (buf->cap == 0)
-      buf->cap = BUFSIZ;
-
-    buf->cap *= 2;
+    // if we haven't used this buffer before, then start small. contexts that
+    // never write much shouldn't hold on to much memory.
+    buf->cap = buf->cap ? buf->cap * 2 : BUF_MIN_CAP;
     char *tmp = realloc(buf->buf, buf->cap);
     if (!tmp) {
       perror("realloc");
@@ -27,12 +28,10 @@ int bufadd(struct mdview_buf *buf, char ch) {
 
 int bufcat(struct mdview_buf *buf, char *str, size_t str_len) {
   // make sure there is enough space in the buffer
-  if (buf->len + str_len >= buf->cap) {
-    // if we haven't used this buffer before, then make it the default size
-    if (buf->cap == 0)
-      buf->cap = BUFSIZ;
-
-    buf->cap *= 2;
+  while (buf->len + str_len >= buf->cap) {
+    // if we haven't used this buffer before, then start small. contexts that
+    // never write much shouldn't hold on to much memory.
+    buf->cap = buf->cap ? buf->cap * 2 : BUF_MIN_CAP;
     char *tmp = realloc(buf->buf, buf->cap);
     if (!tmp) {
       perror("realloc");
@@ -54,3 +53,32 @@ void bufclear(struct mdview_buf *buf) {
   buf->len = 0;
   buf->buf[0] = '\0';
 }
+
+struct mdview_scratch *get_scratch(struct mdview_ctx *ctx) {
+  if (!ctx->scratch) {
+    ctx->scratch = calloc(1, sizeof(struct mdview_scratch));
+    if (!ctx->scratch)
+      perror("calloc");
+  }
+  return ctx->scratch;
+}
+
+int scratch_in_use(const struct mdview_ctx *ctx) {
+  // nested blocks, a code block, a table, or limits that count the input and
+  // output
+  return ctx->block_depth > 0 || ctx->block_type == 9 ||
+         ctx->block_type == 11 || ctx->table_pending || ctx->max_output ||
+         ctx->max_amplification;
+}
+
+void free_scratch(struct mdview_ctx *ctx) {
+  if (!ctx->scratch)
+    return;
+  free(ctx->scratch->tail_temp.buf);
+  free(ctx->scratch->tail_table.buf);
+  free(ctx->scratch->table_buf.buf);
+  free(ctx->scratch->iov_refs);
+  free(ctx->scratch->iov);
+  free(ctx->scratch);
+  ctx->scratch = NULL;
+}
@@ -12,3 +12,66 @@ int bufadd(struct mdview_buf *buf, char ch);
 int bufcat(struct mdview_buf *buf, char *str, size_t str_len);
 // Sets a buffer to an empty string without memset-ing the whole thing.
 void bufclear(struct mdview_buf *buf);
+
+/*
+ * Scratch space for the provisional tail and mdview_feed_iov(), and for state
+ * that most markdown never needs: nested blocks, code blocks, tables, and
+ * limits. It is kept out of the context, so that contexts that use none of
+ * them stay small.
+ *
+ * The parser state in here is only valid while it is in use (see
+ * scratch_in_use()), and the scratch space is always allocated by then: it is
+ * allocated by whatever starts using it (ie: push_block(), block_code(),
+ * table_start(), or a feed with limits), so the rest of the code reads it
+ * through ctx->scratch without checking.
+ */
+
+struct mdview_scratch {
+  // Copies of temp_buf and table_buf used while computing the provisional
+  // tail.
+  struct mdview_buf tail_temp;
+  struct mdview_buf tail_table;
+  // Runs of input that are referenced by the output, in order.
+  struct mdview_iov_ref *iov_refs;
+  size_t iov_refs_len;
+  size_t iov_refs_cap;
+  // Output of the last call to mdview_feed_iov().
+  struct iovec *iov;
+  size_t iov_cap;
+
+  // Limit state
+  size_t in_total;  // bytes of markdown fed
+  size_t out_total; // bytes of HTML generated by previous feeds
+
+  // Blocks that contain the current block, outermost first. There are
+  // ctx->block_depth of them.
+  struct mdview_block block_stack[MDVIEW_BLOCK_DEPTH];
+
+  // Code block state
+  unsigned int code_indent; // indentation of the opening fence, which is
+                            // removed from each line of code
+  char hl_quote; // quote character that started the current string
+  char hl_prev;  // previous character inside strings and comments
+  char hl_word[16]; // the language name, or the word being highlighted
+
+  // Table state
+  unsigned int table_cols;  // number of columns in the table
+  unsigned int table_col;   // number of cells opened in the current row
+  unsigned int table_space; // whitespace in the current cell that isn't
+                            // written until more text follows it
+  size_t table_head_len;    // length of the header row in table_buf
+  unsigned long long table_align; // 2 bits per column, first column in the
+                                  // lowest bits: 0 = none, 1 = left, 2 =
+                                  // center, 3 = right
+  // Raw markdown of a possible table's header and delimiter rows.
+  struct mdview_buf table_buf;
+};
+
+// Returns the scratch space of a context, which is allocated when it is first
+// needed. Returns NULL on error.
+struct mdview_scratch *get_scratch(struct mdview_ctx *ctx);
+// Returns 1 if the scratch space holds parser state that is still needed, so
+// it can't be freed by mdview_release().
+int scratch_in_use(const struct mdview_ctx *ctx);
+// Frees the scratch space of a context.
+void free_scratch(struct mdview_ctx *ctx);
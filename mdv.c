@@ -1,10 +1,19 @@
+#define _XOPEN_SOURCE 700
+
+#include "batch.h"
 #include "lib/mdview.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-void write_html(struct mdview_ctx *ctx, char *html) {
+void write_html(struct mdview_ctx *ctx, char *html, FILE *out) {
   if (html) {
-    if (fputs(html, stdout) == EOF) {
+    if (fputs(html, out) == EOF) {
       perror("fwrite");
       exit(EXIT_FAILURE);
     }
@@ -19,22 +28,177 @@ void write_html(struct mdview_ctx *ctx, char *html) {
   }
 }
 
-int main(int argc, char **argv) {
-  if (argc != 1) {
-    fprintf(stderr, "usage: %s < input.md > output.html\n", argv[0]);
+// Write the iovecs from mdview_feed_iov() to standard output.
+void write_iov(struct mdview_ctx *ctx, struct iovec *iov, int iovcnt) {
+  if (!iov)
+    write_html(ctx, NULL, stdout); // reports the error and exits
+
+  while (iovcnt > 0) {
+    ssize_t written = writev(STDOUT_FILENO, iov, iovcnt < IOV_MAX ? iovcnt
+                                                                  : IOV_MAX);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("writev");
+      exit(EXIT_FAILURE);
+    }
+
+    // skip what was written, which might end in the middle of an iovec
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+void usage(char *name) {
+  fprintf(stderr,
+          "usage: %s < input.md > output.html\n"
+          "       %s -b [-i index] input.md...\n",
+          name, name);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Batch mode
+ */
+
+// Returns 1 if the index file exists and is newer than every document.
+int index_fresh(const char *index_file, int ndocs, char **docs) {
+  struct stat st;
+  if (stat(index_file, &st) == -1)
+    return 0;
+  for (int i = 0; i < ndocs; i++) {
+    struct stat doc_st;
+    if (stat(docs[i], &doc_st) == -1 || doc_st.st_mtime >= st.st_mtime)
+      return 0;
+  }
+  return 1;
+}
+
+void index_doc(void *index, const char *path, char *md, char **out,
+               size_t *out_len) {
+  (void)out;
+  (void)out_len;
+  if (!mdview_index_add(index, path, md)) {
+    fprintf(stderr, "%s: failed to index document\n", path);
     exit(EXIT_FAILURE);
   }
+}
+
+// Build the index of every document, or reuse the index file if it is still
+// up to date.
+void build_index(struct mdview_index *index, const char *index_file,
+                 int ndocs, char **docs) {
+  if (index_file && index_fresh(index_file, ndocs, docs) &&
+      mdview_index_load(index, index_file))
+    return;
+
+  if (!mdview_index_init(index))
+    exit(EXIT_FAILURE);
+  batch_run(ndocs, docs, index_doc, index);
+
+  if (index_file && !mdview_index_save(index, index_file))
+    exit(EXIT_FAILURE);
+}
+
+struct convert_state {
+  const struct mdview_index *index;
+  int broken; // number of broken links in every document
+};
+
+// Add HTML to the output of a document.
+void add_html(struct mdview_ctx *ctx, char *html, char **out,
+              size_t *out_len) {
+  if (!html)
+    write_html(ctx, html, stdout); // reports the error and exits
+
+  size_t len = strlen(html);
+  char *tmp = realloc(*out, *out_len + len + 1);
+  if (!tmp) {
+    perror("memory error");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(tmp + *out_len, html, len + 1);
+  *out = tmp;
+  *out_len += len;
+}
+
+// Convert a document to HTML and report its broken links.
+void convert_doc(void *data, const char *path, char *md, char **out,
+                 size_t *out_len) {
+  struct convert_state *state = data;
+  struct mdview_ctx ctx;
+  mdview_init(&ctx);
+  ctx.index = state->index;
+  ctx.doc_path = path;
+  ctx.ref_defer = 1;
+
+  add_html(&ctx, mdview_feed(&ctx, md), out, out_len);
+  add_html(&ctx, mdview_flush(&ctx), out, out_len);
+
+  char *link = ctx.broken_links.buf;
+  for (char *end; link && (end = strchr(link, '\n')); link = end + 1) {
+    fprintf(stderr, "%s: broken link: %.*s\n", path, (int)(end - link), link);
+    state->broken++;
+  }
+  mdview_free(&ctx);
+}
+
+int batch_main(int argc, char **argv) {
+  char *index_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "bi:")) != -1) {
+    switch (opt) {
+    case 'b':
+      break;
+    case 'i':
+      index_file = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind == argc)
+    usage(argv[0]);
+
+  // index every document first, so that links to documents that come later
+  // can be checked
+  struct mdview_index index;
+  build_index(&index, index_file, argc - optind, argv + optind);
+
+  struct convert_state state = {&index, 0};
+  batch_run(argc - optind, argv + optind, convert_doc, &state);
+
+  mdview_index_free(&index);
+  exit(state.broken ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    batch_main(argc, argv);
+  if (argc != 1)
+    usage(argv[0]);
 
   struct mdview_ctx ctx;
   mdview_init(&ctx);
+  // references are often defined at the end of a document
+  ctx.ref_defer = 1;
 
   char buf[BUFSIZ];
   size_t len_read;
   while ((len_read = fread(buf, 1, BUFSIZ - 1, stdin))) {
     buf[len_read] = '\0';
 
-    char *html = mdview_feed(&ctx, buf);
-    write_html(&ctx, html);
+    // the HTML points into buf, so it is written before buf is reused
+    int iovcnt;
+    struct iovec *iov = mdview_feed_iov(&ctx, buf, &iovcnt);
+    write_iov(&ctx, iov, iovcnt);
   }
   if (ferror(stdin)) {
     perror("fread");
@@ -42,7 +206,7 @@ int main(int argc, char **argv) {
   }
 
   char *html = mdview_flush(&ctx);
-  write_html(&ctx, html);
+  write_html(&ctx, html, stdout);
 
   mdview_free(&ctx);
   exit(EXIT_SUCCESS);
@@ -0,0 +1,313 @@
+// Checks that feeding markdown in any way gives the same HTML as feeding it
+// all at once: in chunks, through mdview_feed_iov(), with a provisional tail,
+// and with UTF-8 validation. Sections rendered on their own must have the same
+// heading IDs as a full render. If NAME.md has a NAME.html next to it, then the
+// whole render must match it too.
+//
+// usage: check file.md...
+
+#include "mdview.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sizes of the chunks that markdown is fed in.
+static const size_t chunk_sizes[] = {1, 2, 3, 7, 64, 4095};
+#define CHUNK_SIZES (sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))
+
+// Provisional tails are compared against a full render of every prefix, so
+// they are only checked on files up to this size.
+#define TAIL_MAX 8192
+
+// Options of a context, applied after mdview_init().
+struct options {
+  int ref_defer;
+  int utf8_policy;
+  int provisional;
+};
+
+static int failures;
+
+static void fail(const char *file, const char *what, size_t chunk) {
+  fprintf(stderr, "FAIL %s: %s (chunk %zu)\n", file, what, chunk);
+  failures++;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+  void *tmp = realloc(ptr, size);
+  if (!tmp) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  return tmp;
+}
+
+static void append(struct mdview_buf *buf, const char *str, size_t len) {
+  if (buf->len + len + 1 > buf->cap) {
+    buf->cap = (buf->len + len + 1) * 2;
+    buf->buf = xrealloc(buf->buf, buf->cap);
+  }
+  memcpy(buf->buf + buf->len, str, len);
+  buf->len += len;
+  buf->buf[buf->len] = '\0';
+}
+
+static void init(struct mdview_ctx *ctx, const struct options *opts) {
+  mdview_init(ctx);
+  ctx->ref_defer = opts->ref_defer;
+  ctx->utf8_policy = opts->utf8_policy;
+  ctx->provisional = opts->provisional;
+}
+
+// Render the first len bytes of md in chunks of the given size. Every other
+// chunk is followed by mdview_release(). Returns NULL on error.
+static char *render(const char *md, size_t len, size_t chunk,
+                    const struct options *opts) {
+  struct mdview_ctx ctx;
+  init(&ctx, opts);
+  struct mdview_buf out = {NULL, 0, 0};
+  char *buf = xrealloc(NULL, chunk + 1);
+  append(&out, "", 0);
+  for (size_t off = 0, i = 0; off < len; off += chunk, i++) {
+    size_t n = len - off < chunk ? len - off : chunk;
+    memcpy(buf, md + off, n);
+    buf[n] = '\0';
+    char *html = mdview_feed(&ctx, buf);
+    if (!html)
+      goto error;
+    append(&out, html, strlen(html));
+    if (i % 2)
+      mdview_release(&ctx);
+  }
+  char *html = mdview_flush(&ctx);
+  if (!html)
+    goto error;
+  append(&out, html, strlen(html));
+  free(buf);
+  mdview_free(&ctx);
+  return out.buf;
+
+error:
+  free(buf);
+  free(out.buf);
+  mdview_free(&ctx);
+  return NULL;
+}
+
+// Render md through mdview_feed_iov() in chunks of the given size.
+static char *render_iov(const char *md, size_t len, size_t chunk,
+                        const struct options *opts) {
+  struct mdview_ctx ctx;
+  init(&ctx, opts);
+  struct mdview_buf out = {NULL, 0, 0};
+  char *buf = xrealloc(NULL, chunk + 1);
+  append(&out, "", 0);
+  for (size_t off = 0; off < len; off += chunk) {
+    size_t n = len - off < chunk ? len - off : chunk;
+    memcpy(buf, md + off, n);
+    buf[n] = '\0';
+    int iovcnt;
+    struct iovec *iov = mdview_feed_iov(&ctx, buf, &iovcnt);
+    if (!iov)
+      goto error;
+    for (int i = 0; i < iovcnt; i++)
+      append(&out, iov[i].iov_base, iov[i].iov_len);
+  }
+  char *html = mdview_flush(&ctx);
+  if (!html)
+    goto error;
+  append(&out, html, strlen(html));
+  free(buf);
+  mdview_free(&ctx);
+  return out.buf;
+
+error:
+  free(buf);
+  free(out.buf);
+  mdview_free(&ctx);
+  return NULL;
+}
+
+// Feed md in chunks with a provisional tail, and check that the output so far
+// followed by the tail is what a full render of the markdown so far gives.
+static void check_tails(const char *file, const char *md, size_t len,
+                        size_t chunk, const struct options *opts) {
+  struct options tail_opts = *opts;
+  tail_opts.provisional = 1;
+  struct mdview_ctx ctx;
+  init(&ctx, &tail_opts);
+  struct mdview_buf out = {NULL, 0, 0};
+  char *buf = xrealloc(NULL, chunk + 1);
+  append(&out, "", 0);
+  for (size_t off = 0; off < len; off += chunk) {
+    size_t n = len - off < chunk ? len - off : chunk;
+    memcpy(buf, md + off, n);
+    buf[n] = '\0';
+    char *html = mdview_feed(&ctx, buf);
+    if (!html) {
+      fail(file, "provisional feed failed", chunk);
+      break;
+    }
+    append(&out, html, strlen(html));
+    // a code point that was cut off isn't in the tail until it is complete
+    if (ctx.utf8_len)
+      continue;
+
+    char *prefix = render(md, off + n, off + n, opts);
+    size_t out_len = out.len;
+    append(&out, ctx.tail_out.buf ? ctx.tail_out.buf : "",
+           ctx.tail_out.buf ? ctx.tail_out.len : 0);
+    int same = prefix && strcmp(prefix, out.buf) == 0;
+    free(prefix);
+    out.len = out_len;
+    out.buf[out.len] = '\0';
+    if (!same) {
+      fprintf(stderr, "FAIL %s: provisional tail after %zu bytes (chunk %zu)\n",
+              file, off + n, chunk);
+      failures++;
+      break;
+    }
+  }
+  free(buf);
+  free(out.buf);
+  mdview_free(&ctx);
+}
+
+// Returns the first heading tag (<hN id="...">) at or after html, or NULL if
+// there isn't one.
+static const char *find_heading(const char *html) {
+  for (const char *p = html; (p = strstr(p, "<h")); p++) {
+    if (p[2] >= '1' && p[2] <= '6' && strncmp(p + 3, " id=\"", 5) == 0)
+      return p;
+  }
+  return NULL;
+}
+
+// Render every section on its own, and check that it starts with the heading
+// that has its ID and level in the full render. The text can differ, ie: if a
+// decoration is still open when the section starts.
+static void check_sections(const char *file, const char *md, size_t len,
+                           const char *full) {
+  struct mdview_sections sections;
+  if (!mdview_sections_scan(&sections, md, len)) {
+    fail(file, "mdview_sections_scan failed", 0);
+    return;
+  }
+  for (size_t i = 0; i < sections.len; i++) {
+    struct mdview_ctx ctx;
+    mdview_init(&ctx);
+    char *html = mdview_render_range(&ctx, md, &sections, i);
+    const char *heading = html ? find_heading(html) : NULL;
+    char tag[32];
+    snprintf(tag, sizeof(tag), "<h%u id=\"%u\">", sections.sections[i].level,
+             sections.sections[i].id);
+    if (!heading || strncmp(heading, tag, strlen(tag)) != 0 ||
+        !strstr(full, tag)) {
+      fprintf(stderr, "FAIL %s: section %zu (id %u) doesn't match the full "
+                      "render\n",
+              file, i, sections.sections[i].id);
+      failures++;
+    }
+    mdview_free(&ctx);
+  }
+  mdview_sections_free(&sections);
+}
+
+// Compare the whole render with NAME.html, if there is one.
+static void check_expected(const char *file, const char *whole) {
+  size_t len = strlen(file);
+  if (len < 3 || strcmp(file + len - 3, ".md") != 0)
+    return;
+  char *path = xrealloc(NULL, len + 3);
+  memcpy(path, file, len - 3);
+  strcpy(path + len - 3, ".html");
+  FILE *f = fopen(path, "rb");
+  free(path);
+  if (!f)
+    return;
+  struct mdview_buf expected = {NULL, 0, 0};
+  char buf[BUFSIZ];
+  size_t n;
+  append(&expected, "", 0);
+  while ((n = fread(buf, 1, sizeof(buf), f)))
+    append(&expected, buf, n);
+  fclose(f);
+  if (strcmp(expected.buf, whole) != 0)
+    fail(file, "output differs from the expected HTML", 0);
+  free(expected.buf);
+}
+
+static void check_file(const char *file) {
+  FILE *f = fopen(file, "rb");
+  if (!f) {
+    perror(file);
+    failures++;
+    return;
+  }
+  struct mdview_buf md = {NULL, 0, 0};
+  char buf[BUFSIZ];
+  size_t n;
+  append(&md, "", 0);
+  while ((n = fread(buf, 1, sizeof(buf), f)))
+    append(&md, buf, n);
+  fclose(f);
+  // the parser stops at a NUL
+  md.len = strlen(md.buf);
+
+  static const struct options configs[] = {
+      {0, 0, 0}, {1, 0, 0}, {0, 1, 0}, {1, 2, 0}};
+  for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    const struct options *opts = &configs[c];
+    char *whole = render(md.buf, md.len, md.len ? md.len : 1, opts);
+    if (!whole) {
+      // invalid UTF-8 is an error with policy 2, no matter how it is fed
+      if (opts->utf8_policy != 2)
+        fail(file, "render failed", md.len);
+      continue;
+    }
+    if (c == 0) {
+      check_expected(file, whole);
+      check_sections(file, md.buf, md.len, whole);
+    }
+
+    for (size_t i = 0; i < CHUNK_SIZES; i++) {
+      char *html = render(md.buf, md.len, chunk_sizes[i], opts);
+      if (!html || strcmp(html, whole) != 0)
+        fail(file, "chunked output differs", chunk_sizes[i]);
+      free(html);
+
+      struct options prov = *opts;
+      prov.provisional = 1;
+      html = render(md.buf, md.len, chunk_sizes[i], &prov);
+      if (!html || strcmp(html, whole) != 0)
+        fail(file, "output with a provisional tail differs", chunk_sizes[i]);
+      free(html);
+
+      html = render_iov(md.buf, md.len, chunk_sizes[i], opts);
+      if (!html || strcmp(html, whole) != 0)
+        fail(file, "mdview_feed_iov() output differs", chunk_sizes[i]);
+      free(html);
+    }
+
+    // placeholders for references are held back, so they aren't in the tail
+    if (!opts->ref_defer && md.len <= TAIL_MAX)
+      check_tails(file, md.buf, md.len, 1, opts);
+    free(whole);
+  }
+  free(md.buf);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s file.md...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  for (int i = 1; i < argc; i++)
+    check_file(argv[i]);
+  if (failures) {
+    fprintf(stderr, "%d check(s) failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("%d file(s) ok\n", argc - 1);
+  return EXIT_SUCCESS;
+}